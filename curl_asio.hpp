@@ -33,17 +33,62 @@
 #include <map>
 #include <set>
 #include <list>
+#include <vector>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <new>
 
+#include <boost/version.hpp>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/utility/base_from_member.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <curl/curl.h>
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
+#ifdef CURL_ASIO_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef CURL_ASIO_ENABLE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__SSE4_2__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#endif
+
+#ifdef CURL_ASIO_ENABLE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#ifdef CURL_ASIO_ENABLE_XXHASH
+#include <xxhash.h>
+#endif
+
 #ifdef CURL_ASIO_DEBUG
 #include <iostream>
 #define CURL_ASIO_LOGSCOPE(func,ptr) log_scope __log(func,ptr)
@@ -60,6 +105,12 @@
 #define __CURL_ASIO_CANCEL_WORKAROUND
 #endif
 
+#if !defined(BOOST_NO_CXX11_THREAD_LOCAL)
+#define CURL_ASIO_THREAD_LOCAL thread_local
+#elif defined(__GNUC__)
+#define CURL_ASIO_THREAD_LOCAL __thread
+#endif
+
 class curl_asio
 {
     class implementation;
@@ -113,8 +164,29 @@ class curl_asio
         unsigned int& counter_;
     };
     
+    template <typename IoObject>
+    static inline boost::asio::io_service& io_service_of(IoObject& object)
+    {
+#if BOOST_VERSION >= 106600
+        return static_cast<boost::asio::io_service&>(object.get_executor().context());
+#else
+        return object.get_io_service();
+#endif
+    }
+    
+    static inline boost::asio::io_service& io_service_of(boost::asio::io_service::strand& strand)
+    {
+#if BOOST_VERSION >= 106600
+        return strand.context();
+#else
+        return strand.get_io_service();
+#endif
+    }
+    
 public:
     class transfer;
+    class shared_transfer;
+    class memory_budget;
     
     explicit curl_asio(boost::asio::io_service& io)
         : impl_(implementation::create(io))
@@ -126,14 +198,51 @@ public:
         impl_->terminate();
     }
     
+    boost::asio::io_service::strand& get_strand() const
+    {
+        return impl_->get_strand();
+    }
+    
+    memory_budget& get_memory_budget() const
+    {
+        return impl_->get_budget();
+    }
+    
+    static std::size_t run_busy(boost::asio::io_service& io)
+    {
+        std::size_t handlers = 0;
+        while (!io.stopped())
+        {
+            std::size_t n = io.poll();
+            handlers += n;
+#if defined(__SSE2__) && defined(__GNUC__)
+            if (!n)
+                _mm_pause();
+#endif
+        }
+        return handlers;
+    }
+    
     boost::shared_ptr<transfer> create_transfer() const
     {
-        boost::shared_ptr<transfer> trans(new transfer(impl_));
+        boost::shared_ptr<transfer> trans(boost::allocate_shared<owned_transfer>(pool_allocator::allocator<owned_transfer>(), transfer::passkey(), impl_));
         if (trans->init())
             return trans;
         return boost::shared_ptr<transfer>();
     }
     
+    template <typename Options>
+    boost::shared_ptr<shared_transfer> create_transfer(const boost::shared_ptr<Options>& profile) const
+    {
+        if (!profile)
+            return boost::shared_ptr<shared_transfer>();
+        
+        boost::shared_ptr<shared_transfer> trans(boost::allocate_shared<shared_transfer>(pool_allocator::allocator<shared_transfer>(), transfer::passkey(), impl_, boost::shared_ptr<const Options>(profile)));
+        if (trans->init())
+            return trans;
+        return boost::shared_ptr<shared_transfer>();
+    }
+    
     struct data_action
     {
         typedef enum
@@ -144,6 +253,418 @@ public:
         } type;
     };
     
+    class error_category: public boost::system::error_category
+    {
+    public:
+        const char *name() const BOOST_SYSTEM_NOEXCEPT
+        {
+            return "curl";
+        }
+        
+        std::string message(int ev) const
+        {
+            return ::curl_easy_strerror(static_cast<CURLcode>(ev));
+        }
+    };
+    
+    static inline const boost::system::error_category& curl_category()
+    {
+        static error_category category;
+        return category;
+    }
+    
+    static inline boost::system::error_code make_error_code(CURLcode code)
+    {
+        return boost::system::error_code(code, curl_category());
+    }
+    
+    struct memory_hooks
+    {
+        curl_malloc_callback malloc_function;
+        curl_free_callback free_function;
+        curl_realloc_callback realloc_function;
+        curl_strdup_callback strdup_function;
+        curl_calloc_callback calloc_function;
+    };
+    
+    static inline bool global_init_mem(const memory_hooks& hooks, long flags = CURL_GLOBAL_ALL)
+    {
+        return ::curl_global_init_mem(flags, hooks.malloc_function, hooks.free_function, hooks.realloc_function, hooks.strdup_function, hooks.calloc_function) == CURLE_OK;
+    }
+    
+    class pool_allocator
+    {
+    public:
+        struct size_class_stats
+        {
+            std::size_t size;
+            boost::uint64_t allocations;
+            boost::uint64_t frees;
+            boost::uint64_t cache_hits;
+        };
+        
+        template <typename T>
+        class allocator
+        {
+        public:
+            typedef T value_type;
+            typedef T *pointer;
+            typedef const T *const_pointer;
+            typedef T &reference;
+            typedef const T &const_reference;
+            typedef std::size_t size_type;
+            typedef std::ptrdiff_t difference_type;
+            
+            template <typename U>
+            struct rebind
+            {
+                typedef allocator<U> other;
+            };
+            
+            allocator() {}
+            
+            template <typename U>
+            allocator(const allocator<U>&) {}
+            
+            pointer address(reference value) const { return &value; }
+            const_pointer address(const_reference value) const { return &value; }
+            
+            pointer allocate(size_type n, const void * = 0)
+            {
+                void *ptr = pool_allocator::allocate(n * sizeof(T));
+                if (!ptr)
+                    throw std::bad_alloc();
+                return static_cast<pointer>(ptr);
+            }
+            
+            void deallocate(pointer ptr, size_type)
+            {
+                pool_allocator::deallocate(ptr);
+            }
+            
+            size_type max_size() const { return static_cast<size_type>(-1) / sizeof(T); }
+            
+            void construct(pointer ptr, const T& value) { new (ptr) T(value); }
+            void destroy(pointer ptr) { ptr->~T(); }
+            
+            bool operator==(const allocator&) const { return true; }
+            bool operator!=(const allocator&) const { return false; }
+        };
+        
+        static inline memory_hooks hooks()
+        {
+            memory_hooks ret;
+            ret.malloc_function = allocate;
+            ret.free_function = deallocate;
+            ret.realloc_function = reallocate;
+            ret.strdup_function = duplicate;
+            ret.calloc_function = allocate_zeroed;
+            return ret;
+        }
+        
+        static inline bool install(long flags = CURL_GLOBAL_ALL)
+        {
+            return global_init_mem(hooks(), flags);
+        }
+        
+        static inline std::vector<size_class_stats> stats()
+        {
+            std::vector<size_class_stats> ret(size_classes + 1);
+            for (std::size_t i = 0; i <= size_classes; ++i)
+            {
+                ret[i].size = i < size_classes ? class_size(i) : 0;
+                ret[i].allocations = global_counters().allocations[i].load(boost::memory_order_relaxed);
+                ret[i].frees = global_counters().frees[i].load(boost::memory_order_relaxed);
+                ret[i].cache_hits = global_counters().cache_hits[i].load(boost::memory_order_relaxed);
+            }
+            return ret;
+        }
+        
+        static inline void *allocate(size_t size)
+        {
+            std::size_t index = size_class(size);
+            global_counters().allocations[index].fetch_add(1, boost::memory_order_relaxed);
+            
+            thread_cache *cache = local_cache();
+            if (cache && index < size_classes && cache->head[index])
+            {
+                char *block = cache->head[index];
+                cache->head[index] = *reinterpret_cast<char**>(block);
+                --cache->count[index];
+                global_counters().cache_hits[index].fetch_add(1, boost::memory_order_relaxed);
+                return block;
+            }
+            
+            std::size_t capacity = index < size_classes ? class_size(index) : size;
+            char *raw = static_cast<char*>(std::malloc(header_size + capacity));
+            if (!raw)
+                return NULL;
+            
+            reinterpret_cast<std::size_t*>(raw)[0] = index;
+            reinterpret_cast<std::size_t*>(raw)[1] = capacity;
+            return raw + header_size;
+        }
+        
+        static inline void deallocate(void *ptr)
+        {
+            if (!ptr)
+                return;
+            
+            char *block = static_cast<char*>(ptr);
+            std::size_t index = reinterpret_cast<std::size_t*>(block - header_size)[0];
+            global_counters().frees[index].fetch_add(1, boost::memory_order_relaxed);
+            
+            thread_cache *cache = local_cache();
+            if (cache && index < size_classes && cache->count[index] < cache_limit(index))
+            {
+                *reinterpret_cast<char**>(block) = cache->head[index];
+                cache->head[index] = block;
+                ++cache->count[index];
+                return;
+            }
+            
+            std::free(block - header_size);
+        }
+        
+        static inline void *reallocate(void *ptr, size_t size)
+        {
+            if (!ptr)
+                return allocate(size);
+            
+            std::size_t capacity = reinterpret_cast<std::size_t*>(static_cast<char*>(ptr) - header_size)[1];
+            if (size <= capacity && size_class(size) == size_class(capacity))
+                return ptr;
+            
+            void *ret = allocate(size);
+            if (ret)
+            {
+                std::memcpy(ret, ptr, std::min<std::size_t>(capacity, size));
+                deallocate(ptr);
+            }
+            return ret;
+        }
+        
+        static inline char *duplicate(const char *str)
+        {
+            std::size_t len = std::strlen(str) + 1;
+            char *ret = static_cast<char*>(allocate(len));
+            if (ret)
+                std::memcpy(ret, str, len);
+            return ret;
+        }
+        
+        static inline void *allocate_zeroed(size_t nmemb, size_t size)
+        {
+            if (size && nmemb > static_cast<size_t>(-1) / size)
+                return NULL;
+            
+            void *ret = allocate(nmemb * size);
+            if (ret)
+                std::memset(ret, 0, nmemb * size);
+            return ret;
+        }
+        
+    private:
+        enum
+        {
+            size_classes = 9,
+            min_class_shift = 4,
+            header_size = 16,
+            cache_bytes = 16 * 1024
+        };
+        
+        struct counters
+        {
+            boost::atomic<boost::uint64_t> allocations[size_classes + 1];
+            boost::atomic<boost::uint64_t> frees[size_classes + 1];
+            boost::atomic<boost::uint64_t> cache_hits[size_classes + 1];
+            
+            counters()
+            {
+                for (std::size_t i = 0; i <= size_classes; ++i)
+                {
+                    allocations[i] = 0;
+                    frees[i] = 0;
+                    cache_hits[i] = 0;
+                }
+            }
+        };
+        
+        struct thread_cache
+        {
+            char *head[size_classes];
+            std::size_t count[size_classes];
+        };
+        
+        static inline counters& global_counters()
+        {
+            static counters instance;
+            return instance;
+        }
+        
+        static inline thread_cache *local_cache()
+        {
+#ifdef CURL_ASIO_THREAD_LOCAL
+            static CURL_ASIO_THREAD_LOCAL thread_cache cache;
+            return &cache;
+#else
+            return NULL;
+#endif
+        }
+        
+        static inline std::size_t class_size(std::size_t index)
+        {
+            return static_cast<std::size_t>(1) << (index + min_class_shift);
+        }
+        
+        static inline std::size_t size_class(std::size_t size)
+        {
+            std::size_t index = 0;
+            while (index < size_classes && class_size(index) < size)
+                ++index;
+            return index;
+        }
+        
+        static inline std::size_t cache_limit(std::size_t index)
+        {
+            return std::max<std::size_t>(cache_bytes / class_size(index), 4);
+        }
+    };
+    
+    class global_init: private boost::noncopyable
+    {
+    public:
+        explicit global_init(long flags = CURL_GLOBAL_ALL)
+            : ok_(acquire(flags, NULL, false))
+        {
+        }
+        
+        global_init(const memory_hooks& hooks, long flags = CURL_GLOBAL_ALL)
+            : ok_(acquire(flags, &hooks, false))
+        {
+        }
+        
+        ~global_init()
+        {
+            if (ok_)
+                release();
+        }
+        
+        bool ok() const { return ok_; }
+        
+        static inline long flags()
+        {
+            state& s(get_state());
+            boost::mutex::scoped_lock lock(s.mutex);
+            return s.flags;
+        }
+        
+        static inline boost::posix_time::time_duration init_time()
+        {
+            state& s(get_state());
+            boost::mutex::scoped_lock lock(s.mutex);
+            return s.init_time;
+        }
+        
+        static inline std::size_t references()
+        {
+            state& s(get_state());
+            boost::mutex::scoped_lock lock(s.mutex);
+            return s.references;
+        }
+        
+    private:
+        friend class implementation;
+        friend class transfer;
+        
+        struct attach_existing {};
+        
+        struct state
+        {
+            boost::mutex mutex;
+            std::size_t references;
+            long flags;
+            bool custom_hooks;
+            memory_hooks hooks;
+            boost::posix_time::time_duration init_time;
+            
+            state()
+                : references(0),
+                  flags(0),
+                  custom_hooks(false)
+            {
+            }
+        };
+        
+        const bool ok_;
+        
+        explicit global_init(const attach_existing&)
+            : ok_(attach())
+        {
+        }
+        
+        static inline state& get_state()
+        {
+            static state instance;
+            return instance;
+        }
+        
+        static inline bool same_hooks(const memory_hooks& a, const memory_hooks& b)
+        {
+            return a.malloc_function == b.malloc_function && a.free_function == b.free_function && a.realloc_function == b.realloc_function && a.strdup_function == b.strdup_function && a.calloc_function == b.calloc_function;
+        }
+        
+        static inline bool acquire(long flags, const memory_hooks *hooks, bool attach)
+        {
+            state& s(get_state());
+            boost::mutex::scoped_lock lock(s.mutex);
+            
+            if (s.references == 0)
+            {
+                boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+                bool ok = hooks ? global_init_mem(*hooks, flags) : ::curl_global_init(flags) == CURLE_OK;
+                if (!ok)
+                    return false;
+                
+                s.init_time = boost::posix_time::microsec_clock::universal_time() - start;
+                s.flags = flags;
+                s.custom_hooks = hooks != NULL;
+                if (hooks)
+                    s.hooks = *hooks;
+            }
+            else if (!attach && (flags != s.flags || (hooks != NULL) != s.custom_hooks || (hooks && !same_hooks(*hooks, s.hooks))))
+                return false;
+            
+            ++s.references;
+            return true;
+        }
+        
+        static inline bool attach()
+        {
+            return acquire(CURL_GLOBAL_ALL, NULL, true);
+        }
+        
+        static inline void release()
+        {
+            state& s(get_state());
+            boost::mutex::scoped_lock lock(s.mutex);
+            
+            if (--s.references == 0)
+                ::curl_global_cleanup();
+        }
+    };
+    
+    struct buffer_sizing
+    {
+        typedef enum
+        {
+            standard,
+            bulk,
+            low_memory,
+            adaptive
+        } type;
+    };
+    
     struct header_action
     {
         typedef enum
@@ -164,6 +685,54 @@ public:
         typedef boost::function<header_action::type(const std::string &line)> header_handler;
         typedef boost::function<void(CURLcode)> done_handler;
         
+        struct form_part
+        {
+            typedef boost::shared_ptr< const std::vector<char> > shared_buffer;
+            
+            std::string name;
+            std::string filename;
+            std::string content_type;
+            boost::asio::const_buffer data;
+            shared_buffer shared_data;
+            std::string path;
+            curl_off_t offset;
+            curl_off_t length;
+            
+            form_part()
+                : offset(0),
+                  length(-1)
+            {
+            }
+            
+            static inline form_part buffer(const std::string &name, const boost::asio::const_buffer& data)
+            {
+                form_part part;
+                part.name = name;
+                part.data = data;
+                return part;
+            }
+            
+            static inline form_part shared(const std::string &name, const shared_buffer& data)
+            {
+                form_part part;
+                part.name = name;
+                part.shared_data = data;
+                if (data)
+                    part.data = boost::asio::buffer(*data);
+                return part;
+            }
+            
+            static inline form_part file(const std::string &name, const std::string &path, curl_off_t offset = 0, curl_off_t length = -1)
+            {
+                form_part part;
+                part.name = name;
+                part.path = path;
+                part.offset = offset;
+                part.length = length;
+                return part;
+            }
+        };
+        
         struct options
         {
             long protocols;
@@ -173,6 +742,9 @@ public:
             bool follow_location;
             bool auto_referer;
             bool http_proxy_tunnel;
+            bool upload;
+            bool post;
+            curl_off_t upload_size;
             std::string proxy;
             std::string no_proxy;
             std::string proxy_username;
@@ -180,11 +752,22 @@ public:
             long proxy_port;
             long proxy_type;
             bool accept_all_supported_encodings;
+            bool raw_passthrough;
             std::string accept_encoding;
             std::string referer;
             std::string useragent;
             std::list<std::string> http_header;
             std::string interface;
+            std::size_t coalesce_size;
+            long coalesce_timeout_ms;
+            buffer_sizing::type buffer_profile;
+            long buffer_size;
+            long upload_buffer_size;
+            long connect_only;
+            long http_version;
+            long busy_poll_us;
+            int budget_priority;
+            std::list<form_part> form;
             
             options()
                 : protocols(CURLPROTO_ALL),
@@ -194,9 +777,22 @@ public:
                   follow_location(false),
                   auto_referer(false),
                   http_proxy_tunnel(false),
+                  upload(false),
+                  post(false),
+                  upload_size(-1),
                   proxy_port(1080),
                   proxy_type(CURLPROXY_HTTP),
-                  accept_all_supported_encodings(true)
+                  accept_all_supported_encodings(true),
+                  raw_passthrough(false),
+                  coalesce_size(0),
+                  coalesce_timeout_ms(0),
+                  buffer_profile(buffer_sizing::standard),
+                  buffer_size(0),
+                  upload_buffer_size(0),
+                  connect_only(0),
+                  http_version(CURL_HTTP_VERSION_NONE),
+                  busy_poll_us(0),
+                  budget_priority(0)
             {
             }
         };
@@ -288,15 +884,70 @@ public:
                 return ret;
             }
             
-        private:
-            friend class transfer;
+            curl_off_t size_download() const
+            {
+                curl_off_t ret = 0;
+#if LIBCURL_VERSION_NUM >= 0x073700
+                get_info(CURLINFO_SIZE_DOWNLOAD_T, ret);
+#else
+                get_info(CURLINFO_SIZE_DOWNLOAD, ret);
+#endif
+                return ret;
+            }
             
-            transferinfo(CURL*& handle)
-                : handle_(handle)
+            curl_off_t size_upload() const
             {
+                curl_off_t ret = 0;
+#if LIBCURL_VERSION_NUM >= 0x073700
+                get_info(CURLINFO_SIZE_UPLOAD_T, ret);
+#else
+                get_info(CURLINFO_SIZE_UPLOAD, ret);
+#endif
+                return ret;
             }
             
-            bool get_info(CURLINFO option, std::string &val) const
+            curl_off_t speed_download() const
+            {
+                curl_off_t ret = 0;
+#if LIBCURL_VERSION_NUM >= 0x073700
+                get_info(CURLINFO_SPEED_DOWNLOAD_T, ret);
+#else
+                get_info(CURLINFO_SPEED_DOWNLOAD, ret);
+#endif
+                return ret;
+            }
+            
+            curl_off_t speed_upload() const
+            {
+                curl_off_t ret = 0;
+#if LIBCURL_VERSION_NUM >= 0x073700
+                get_info(CURLINFO_SPEED_UPLOAD_T, ret);
+#else
+                get_info(CURLINFO_SPEED_UPLOAD, ret);
+#endif
+                return ret;
+            }
+            
+            curl_off_t content_length_download() const
+            {
+                curl_off_t ret = -1;
+#if LIBCURL_VERSION_NUM >= 0x073700
+                get_info(CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, ret);
+#else
+                get_info(CURLINFO_CONTENT_LENGTH_DOWNLOAD, ret);
+#endif
+                return ret;
+            }
+            
+        private:
+            friend class transfer;
+            
+            transferinfo(CURL*& handle)
+                : handle_(handle)
+            {
+            }
+            
+            bool get_info(CURLINFO option, std::string &val) const
             {
                 const char *str = NULL;
                 CURLcode rc = ::curl_easy_getinfo(handle_, option, &str);
@@ -322,6 +973,20 @@ public:
                 return ::curl_easy_getinfo(handle_, option, &val) == CURLE_OK;
             }
             
+            template <typename Offset>
+            bool get_info(CURLINFO option, Offset &val) const
+            {
+#if LIBCURL_VERSION_NUM >= 0x073700
+                return ::curl_easy_getinfo(handle_, option, &val) == CURLE_OK;
+#else
+                double ret = 0.0;
+                if (!get_info(option, ret))
+                    return false;
+                val = static_cast<Offset>(ret);
+                return true;
+#endif
+            }
+            
             CURL*& handle_;
         };
         
@@ -332,10 +997,16 @@ public:
                 ::curl_easy_cleanup(handle_);
             if (httpheader_)
                 ::curl_slist_free_all(httpheader_);
+#if LIBCURL_VERSION_NUM >= 0x073800
+            if (mime_)
+                ::curl_mime_free(mime_);
+#endif
+            if (handle_)
+                global_init::release();
         }
         
         const std::string& url;
-        options opt;
+        options& opt;
         done_handler on_done;
         data_read_handler on_data_read;
         data_write_handler on_data_write;
@@ -343,284 +1014,4166 @@ public:
         
         bool start(const std::string &uri)
         {
-            if (running_ || !impl_ || callback_recursions_ > 0)
-                return false;
-            
-            if (!init())
-                return false;
-            
-            if (!setup(uri))
-                return false;
-            
-            if (impl_->add_transfer(shared_from_this()))
+            if (running_ || connected_ || !impl_ || callback_recursions_ > 0)
+                return false;
+            
+            if (!init())
+                return false;
+            
+            if (!setup(uri))
+                return false;
+            
+            if (impl_->add_transfer(shared_from_this()))
+            {
+                running_ = true;
+                return true;
+            }
+            
+            return false;
+        }
+        
+        bool stop()
+        {
+            if ((!running_ && !connected_) || !impl_)
+                return false;
+            
+            if (callback_recursions_ > 0 && !connected_)
+            {
+                running_ = false;
+                return true;
+            }
+            
+            if (impl_->remove_transfer(shared_from_this()))
+            {
+                running_ = false;
+                connected_ = false;
+                reset_coalesced();
+                run_done_hooks(run_result_filters(CURLE_ABORTED_BY_CALLBACK));
+                return true;
+            }
+            
+            return false;
+        }
+        
+        bool pause(int what = CURLPAUSE_ALL)
+        {
+            if (!running_ || !impl_)
+                return false;
+            
+            pause_state_ |= what;
+            return ::curl_easy_pause(handle_, pause_state_) == CURLE_OK;
+        }
+        
+        void resume(int what = CURLPAUSE_ALL)
+        {
+            if (running_ && impl_)
+                impl_->post(boost::bind(&transfer::do_resume, shared_from_this(), what));
+        }
+        
+        const transferinfo& info() const { return info_; }
+        
+        bool running() const { return running_; }
+        
+        bool connected() const { return connected_; }
+        
+        bool paused(int what = CURLPAUSE_ALL) const { return (pause_state_ & what) != 0; }
+        
+        const std::string& content_encoding() const
+        {
+            static const std::string none;
+            return extras_ ? extras_->content_encoding : none;
+        }
+        
+        bool shares_options() const { return profile_.get() != NULL; }
+        
+        boost::posix_time::time_duration budget_paused_time() const
+        {
+            return extras_ ? extras_->budget_paused : boost::posix_time::time_duration();
+        }
+        
+    private:
+        friend class curl_asio;
+        friend class socketinfo;
+        friend class implementation;
+        friend class upload_stream;
+        friend class memory_budget;
+        template <typename> friend class relay;
+        friend class tee;
+        friend class callback_offload;
+        friend class line_splitter;
+        friend class message_splitter;
+        friend class digest_verifier;
+        friend class event_source;
+        friend class grpc_call;
+        friend class connection;
+        
+        enum
+        {
+            min_buffer_size = 1024,
+            max_buffer_size = 512 * 1024,
+            min_upload_buffer_size = 16 * 1024,
+            max_upload_buffer_size = 2 * 1024 * 1024,
+            adaptive_buffer_rate = 100,
+            adaptive_buffer_budget = 64 * 1024 * 1024
+        };
+        
+        typedef boost::function<CURLcode(CURLcode)> result_filter;
+        
+        struct extras
+        {
+            std::string content_encoding;
+            std::vector<result_filter> result_filters;
+            std::vector<char> coalesce_buffer;
+            boost::shared_ptr<boost::asio::deadline_timer> coalesce_timer;
+            bool coalesce_timer_armed;
+            boost::posix_time::time_duration budget_paused;
+            
+            extras()
+                : coalesce_timer_armed(false)
+            {
+            }
+        };
+        
+        boost::shared_ptr<implementation> impl_;
+        boost::shared_ptr<const options> profile_;
+        CURL* handle_;
+        curl_slist *httpheader_;
+#if LIBCURL_VERSION_NUM >= 0x073800
+        curl_mime *mime_;
+#endif
+        transferinfo info_;
+        unsigned int callback_recursions_;
+        bool running_ : 1;
+        bool connected_ : 1;
+        unsigned int pause_state_ : 4;
+        long adaptive_buffer_size_;
+        long adaptive_upload_buffer_size_;
+        std::string url_;
+        boost::shared_ptr<transfer> lock_;
+        std::vector<done_handler> done_hooks_;
+        boost::scoped_ptr<extras> extras_;
+        
+        static inline boost::shared_ptr<transfer> from_easy(CURL *easy)
+        {
+            void *trans;
+            CURLcode rc = ::curl_easy_getinfo(easy, CURLINFO_PRIVATE, &trans);
+            if (rc == CURLE_OK && trans)
+                return static_cast<transfer*>(trans)->shared_from_this();
+            return boost::shared_ptr<transfer>();
+        }
+        
+        static inline boost::shared_ptr<transfer> from_ptr(void *ptr)
+        {
+            return static_cast<transfer*>(ptr)->shared_from_this();
+        }
+        
+    public:
+        class passkey
+        {
+            friend class curl_asio;
+            passkey() {}
+        };
+        
+        transfer(const passkey&, boost::shared_ptr<implementation> impl, options& storage, boost::shared_ptr<const options> profile = boost::shared_ptr<const options>())
+            : url(url_),
+              opt(storage),
+              impl_(impl),
+              profile_(profile),
+              handle_(NULL),
+              httpheader_(NULL),
+#if LIBCURL_VERSION_NUM >= 0x073800
+              mime_(NULL),
+#endif
+              info_(handle_),
+              callback_recursions_(0),
+              running_(false),
+              connected_(false),
+              pause_state_(CURLPAUSE_CONT),
+              adaptive_buffer_size_(0),
+              adaptive_upload_buffer_size_(0)
+        {
+            CURL_ASIO_LOGSCOPE("transfer::transfer", this);
+        }
+        
+    private:
+        bool setup(const std::string &uri)
+        {
+            ::curl_easy_setopt(handle_, CURLOPT_URL, uri.c_str());
+            
+            ::curl_easy_setopt(handle_, CURLOPT_PROTOCOLS, opt.protocols);
+            ::curl_easy_setopt(handle_, CURLOPT_MAXREDIRS, opt.max_redirs);
+            ::curl_easy_setopt(handle_, CURLOPT_REDIR_PROTOCOLS, opt.redir_protocols);
+            ::curl_easy_setopt(handle_, CURLOPT_FAILONERROR, opt.fail_on_error ? 1l : 0l);
+            ::curl_easy_setopt(handle_, CURLOPT_FOLLOWLOCATION, opt.follow_location ? 1l : 0l);
+            ::curl_easy_setopt(handle_, CURLOPT_AUTOREFERER, opt.auto_referer ? 1l : 0l);
+            ::curl_easy_setopt(handle_, CURLOPT_HTTPPROXYTUNNEL, opt.http_proxy_tunnel ? 1l : 0l);
+            if (opt.upload)
+            {
+                ::curl_easy_setopt(handle_, CURLOPT_UPLOAD, 1l);
+                ::curl_easy_setopt(handle_, CURLOPT_INFILESIZE_LARGE, opt.upload_size);
+            }
+            else if (opt.post)
+            {
+                ::curl_easy_setopt(handle_, CURLOPT_POST, 1l);
+                ::curl_easy_setopt(handle_, CURLOPT_POSTFIELDSIZE_LARGE, opt.upload_size);
+            }
+            if (!opt.proxy.empty())
+                ::curl_easy_setopt(handle_, CURLOPT_PROXY, opt.proxy.c_str());
+            if (!opt.no_proxy.empty())
+                ::curl_easy_setopt(handle_, CURLOPT_NOPROXY, opt.no_proxy.c_str());
+            if (!opt.proxy_username.empty() || !opt.proxy_password.empty())
+            {
+                ::curl_easy_setopt(handle_, CURLOPT_PROXYUSERNAME, opt.proxy_username.c_str());
+                ::curl_easy_setopt(handle_, CURLOPT_PROXYPASSWORD, opt.proxy_password.c_str());
+            }
+            ::curl_easy_setopt(handle_, CURLOPT_PROXYPORT, opt.proxy_port);
+            ::curl_easy_setopt(handle_, CURLOPT_PROXYTYPE, opt.proxy_type);
+            if (opt.accept_all_supported_encodings)
+                ::curl_easy_setopt(handle_, CURLOPT_ACCEPT_ENCODING, "");
+            else
+                ::curl_easy_setopt(handle_, CURLOPT_ACCEPT_ENCODING, opt.accept_encoding.empty() ? NULL : opt.accept_encoding.c_str());
+            if (opt.raw_passthrough)
+                ::curl_easy_setopt(handle_, CURLOPT_HTTP_CONTENT_DECODING, 0l);
+            if (!opt.referer.empty())
+                ::curl_easy_setopt(handle_, CURLOPT_REFERER, opt.referer.c_str());
+            if (!opt.useragent.empty())
+                ::curl_easy_setopt(handle_, CURLOPT_USERAGENT, opt.useragent.c_str());
+            if (!opt.http_header.empty())
+            {
+                for (std::list<std::string>::const_iterator it(opt.http_header.begin()); it != opt.http_header.end(); ++it)
+                {
+                    curl_slist *new_list = ::curl_slist_append(httpheader_, it->c_str());
+                    if (!new_list)
+                        return false;
+                    httpheader_ = new_list;
+                }
+                
+                ::curl_easy_setopt(handle_, CURLOPT_HTTPHEADER, httpheader_);
+            }
+            
+            if (!opt.interface.empty())
+                ::curl_easy_setopt(handle_, CURLOPT_INTERFACE, ("if!" + opt.interface).c_str());
+            
+            setup_buffer_sizes();
+            
+            if (!opt.form.empty() && !setup_form())
+                return false;
+            
+            if (opt.connect_only)
+                ::curl_easy_setopt(handle_, CURLOPT_CONNECT_ONLY, opt.connect_only);
+            if (opt.http_version != CURL_HTTP_VERSION_NONE)
+                ::curl_easy_setopt(handle_, CURLOPT_HTTP_VERSION, opt.http_version);
+#ifdef SO_BUSY_POLL
+            if (opt.busy_poll_us > 0)
+            {
+                ::curl_easy_setopt(handle_, CURLOPT_SOCKOPTFUNCTION, curl_sockopt_function);
+                ::curl_easy_setopt(handle_, CURLOPT_SOCKOPTDATA, this);
+            }
+#endif
+            
+            ::curl_easy_setopt(handle_, CURLOPT_WRITEFUNCTION, curl_write_function);
+            ::curl_easy_setopt(handle_, CURLOPT_WRITEDATA, this);
+            
+            ::curl_easy_setopt(handle_, CURLOPT_READFUNCTION, curl_read_function);
+            ::curl_easy_setopt(handle_, CURLOPT_READDATA, this);
+            
+            ::curl_easy_setopt(handle_, CURLOPT_HEADERFUNCTION, curl_header_function);
+            ::curl_easy_setopt(handle_, CURLOPT_HEADERDATA, this);
+            
+            url_ = uri;
+            return true;
+        }
+        
+        void setup_buffer_sizes()
+        {
+            long buffer_size = opt.buffer_size;
+            long upload_buffer_size = opt.upload_buffer_size;
+            
+            switch (opt.buffer_profile)
+            {
+                case buffer_sizing::bulk:
+                    buffer_size = max_buffer_size;
+                    upload_buffer_size = max_upload_buffer_size;
+                    break;
+                case buffer_sizing::low_memory:
+                    buffer_size = min_buffer_size;
+                    upload_buffer_size = min_upload_buffer_size;
+                    break;
+                case buffer_sizing::adaptive:
+                {
+                    long budget = std::max(static_cast<long>(min_buffer_size), static_cast<long>(adaptive_buffer_budget / (impl_->transfers_.size() + 1)));
+                    buffer_size = std::min(adaptive_buffer_size_ ? adaptive_buffer_size_ : static_cast<long>(CURL_MAX_WRITE_SIZE), budget);
+                    upload_buffer_size = adaptive_upload_buffer_size_;
+                    break;
+                }
+                case buffer_sizing::standard:
+                default:
+                    break;
+            }
+            
+            if (buffer_size > 0)
+                ::curl_easy_setopt(handle_, CURLOPT_BUFFERSIZE, buffer_size);
+#if LIBCURL_VERSION_NUM >= 0x073e00
+            if (upload_buffer_size > 0)
+                ::curl_easy_setopt(handle_, CURLOPT_UPLOAD_BUFFERSIZE, upload_buffer_size);
+#endif
+        }
+        
+        class form_reader: private boost::noncopyable
+        {
+        public:
+            static inline form_reader *open(const form_part& part)
+            {
+                if (part.path.empty())
+                    return new form_reader(part.data, part.shared_data);
+                
+                if (part.offset < 0)
+                    return NULL;
+                
+                int fd = ::open(part.path.c_str(), O_RDONLY);
+                if (fd < 0)
+                    return NULL;
+                
+                struct stat st;
+                if (::fstat(fd, &st) < 0 || part.offset > st.st_size)
+                {
+                    ::close(fd);
+                    return NULL;
+                }
+                
+                curl_off_t length = st.st_size - part.offset;
+                if (part.length >= 0 && part.length < length)
+                    length = part.length;
+                return new form_reader(fd, part.offset, length);
+            }
+            
+            ~form_reader()
+            {
+                if (fd_ >= 0)
+                    ::close(fd_);
+            }
+            
+            curl_off_t size() const { return size_; }
+            
+            static inline size_t curl_read_function(char *buffer, size_t size, size_t nitems, void *arg)
+            {
+                form_reader *reader = static_cast<form_reader*>(arg);
+                std::size_t n = static_cast<std::size_t>(std::min(static_cast<curl_off_t>(size * nitems), reader->size_ - reader->pos_));
+                if (n == 0)
+                    return 0;
+                
+                if (reader->fd_ < 0)
+                    std::memcpy(buffer, reader->data_ + reader->pos_, n);
+                else
+                {
+                    ssize_t rc = ::pread(reader->fd_, buffer, n, reader->offset_ + reader->pos_);
+                    if (rc < 0)
+                        return CURL_READFUNC_ABORT;
+                    n = static_cast<std::size_t>(rc);
+                }
+                reader->pos_ += n;
+                return n;
+            }
+            
+            static inline int curl_seek_function(void *arg, curl_off_t offset, int origin)
+            {
+                form_reader *reader = static_cast<form_reader*>(arg);
+                if (origin == SEEK_CUR)
+                    offset += reader->pos_;
+                else if (origin == SEEK_END)
+                    offset += reader->size_;
+                if (offset < 0 || offset > reader->size_)
+                    return CURL_SEEKFUNC_FAIL;
+                
+                reader->pos_ = offset;
+                return CURL_SEEKFUNC_OK;
+            }
+            
+            static inline void curl_free_function(void *arg)
+            {
+                delete static_cast<form_reader*>(arg);
+            }
+            
+        private:
+            const char *data_;
+            form_part::shared_buffer shared_data_;
+            int fd_;
+            curl_off_t offset_;
+            curl_off_t size_;
+            curl_off_t pos_;
+            
+            form_reader(const boost::asio::const_buffer& data, const form_part::shared_buffer& shared_data)
+                : data_(boost::asio::buffer_cast<const char*>(data)),
+                  shared_data_(shared_data),
+                  fd_(-1),
+                  offset_(0),
+                  size_(boost::asio::buffer_size(data)),
+                  pos_(0)
+            {
+            }
+            
+            form_reader(int fd, curl_off_t offset, curl_off_t size)
+                : data_(NULL),
+                  fd_(fd),
+                  offset_(offset),
+                  size_(size),
+                  pos_(0)
+            {
+            }
+        };
+        
+        bool setup_form()
+        {
+#if LIBCURL_VERSION_NUM >= 0x073800
+            mime_ = ::curl_mime_init(handle_);
+            if (!mime_)
+                return false;
+            
+            for (std::list<form_part>::const_iterator it(opt.form.begin()); it != opt.form.end(); ++it)
+            {
+                curl_mimepart *part = ::curl_mime_addpart(mime_);
+                if (!part)
+                    return false;
+                
+                form_reader *reader = form_reader::open(*it);
+                if (!reader)
+                    return false;
+                
+                if (::curl_mime_data_cb(part, reader->size(), form_reader::curl_read_function, form_reader::curl_seek_function, form_reader::curl_free_function, reader) != CURLE_OK)
+                {
+                    delete reader;
+                    return false;
+                }
+                
+                if (!it->name.empty())
+                    ::curl_mime_name(part, it->name.c_str());
+                if (!it->filename.empty())
+                    ::curl_mime_filename(part, it->filename.c_str());
+                if (!it->content_type.empty())
+                    ::curl_mime_type(part, it->content_type.c_str());
+            }
+            
+            ::curl_easy_setopt(handle_, CURLOPT_MIMEPOST, mime_);
+            return true;
+#else
+            return false;
+#endif
+        }
+        
+        static inline long adapt_buffer_size(curl_off_t speed, long min_size, long max_size)
+        {
+            long target = static_cast<long>(speed / adaptive_buffer_rate);
+            long size = min_size;
+            while (size < target && size < max_size)
+                size *= 2;
+            return std::min(size, max_size);
+        }
+        
+        void record_buffer_sizes()
+        {
+            if (opt.buffer_profile != buffer_sizing::adaptive)
+                return;
+            
+            if (info_.size_download() > 0)
+                adaptive_buffer_size_ = adapt_buffer_size(info_.speed_download(), min_buffer_size, max_buffer_size);
+            if (info_.size_upload() > 0)
+                adaptive_upload_buffer_size_ = adapt_buffer_size(info_.speed_upload(), min_upload_buffer_size, max_upload_buffer_size);
+        }
+        
+        bool init()
+        {
+            CURL_ASIO_LOGSCOPE("transfer::init", this);
+            
+            if (handle_)
+                ::curl_easy_reset(handle_);
+            else
+            {
+                if (!global_init::attach())
+                    return false;
+                
+                handle_ = ::curl_easy_init();
+                if (!handle_)
+                {
+                    global_init::release();
+                    return false;
+                }
+            }
+            
+            if (httpheader_)
+            {
+                ::curl_slist_free_all(httpheader_);
+                httpheader_ = NULL;
+            }
+            
+#if LIBCURL_VERSION_NUM >= 0x073800
+            if (mime_)
+            {
+                ::curl_mime_free(mime_);
+                mime_ = NULL;
+            }
+#endif
+            
+            ::curl_easy_setopt(handle_, CURLOPT_PRIVATE, this);
+            ::curl_easy_setopt(handle_, CURLOPT_NOSIGNAL, 1l);
+            pause_state_ = CURLPAUSE_CONT;
+            if (extras_)
+                extras_->content_encoding.clear();
+            reset_coalesced();
+            return true;
+        }
+        
+        void terminate()
+        {
+            impl_.reset();
+            run_done_hooks(CURLE_ABORTED_BY_CALLBACK);
+            unlock();
+        }
+        
+        void lock() { lock_ = shared_from_this(); }
+        void unlock() { lock_.reset(); }
+        
+        void add_done_hook(const done_handler& hook)
+        {
+            done_hooks_.push_back(hook);
+        }
+        
+        void add_result_filter(const result_filter& filter)
+        {
+            get_extras().result_filters.push_back(filter);
+        }
+        
+        CURLcode run_result_filters(CURLcode result)
+        {
+            if (!extras_)
+                return result;
+            
+            std::vector<result_filter> filters;
+            filters.swap(extras_->result_filters);
+            for (std::vector<result_filter>::const_iterator it(filters.begin()); it != filters.end(); ++it)
+                result = (*it)(result);
+            return result;
+        }
+        
+        void run_done_hooks(CURLcode result)
+        {
+            std::vector<done_handler> hooks;
+            hooks.swap(done_hooks_);
+            for (std::vector<done_handler>::const_iterator it(hooks.begin()); it != hooks.end(); ++it)
+                (*it)(result);
+        }
+        
+        void do_resume(int what)
+        {
+            if (!running_ || !impl_ || !(pause_state_ & what))
+                return;
+            
+            pause_state_ &= ~what;
+            ::curl_easy_pause(handle_, pause_state_);
+        }
+        
+        void handle_done(CURLcode result)
+        {
+            CURL_ASIO_LOG("transfer::handle_done: result=" << result);
+            if (result == CURLE_OK && impl_ && on_data_read)
+                flush_coalesced();
+            reset_coalesced();
+            record_buffer_sizes();
+            result = run_result_filters(result);
+            run_done_hooks(result);
+            if (on_done)
+                on_done(result);
+            running_ = false;
+        }
+        
+        data_action::type deliver(const boost::asio::const_buffer& buffer)
+        {
+            callback_protector protector(callback_recursions_);
+            data_action::type action = on_data_read(buffer);
+            
+            if (!running_)
+                return data_action::abort;
+            
+            return action;
+        }
+        
+        size_t write_function(char *ptr, size_t size)
+        {
+            if (impl_ && on_data_read)
+            {
+                if (opt.coalesce_size > 0)
+                    return coalesce(ptr, size);
+                
+                switch (deliver(boost::asio::const_buffer(ptr, size)))
+                {
+                    case data_action::success:
+                        return size;
+                    case data_action::pause:
+                        pause_state_ |= CURLPAUSE_RECV;
+                        return CURL_WRITEFUNC_PAUSE;
+                    case data_action::abort:
+                    default:
+                        break;
+                }
+            }
+            
+            return 0;
+        }
+        
+        extras& get_extras()
+        {
+            if (!extras_)
+                extras_.reset(new extras());
+            return *extras_;
+        }
+        
+        size_t coalesce(char *ptr, size_t size)
+        {
+            std::vector<char>& coalesce_buffer(get_extras().coalesce_buffer);
+            if (!coalesce_buffer.empty() && coalesce_buffer.size() + size > opt.coalesce_size)
+            {
+                switch (flush_coalesced())
+                {
+                    case data_action::success:
+                        break;
+                    case data_action::pause:
+                        pause_state_ |= CURLPAUSE_RECV;
+                        return CURL_WRITEFUNC_PAUSE;
+                    case data_action::abort:
+                    default:
+                        return 0;
+                }
+            }
+            
+            if (coalesce_buffer.empty() && size >= opt.coalesce_size)
+            {
+                switch (deliver(boost::asio::const_buffer(ptr, size)))
+                {
+                    case data_action::success:
+                        return size;
+                    case data_action::pause:
+                        pause_state_ |= CURLPAUSE_RECV;
+                        return CURL_WRITEFUNC_PAUSE;
+                    case data_action::abort:
+                    default:
+                        return 0;
+                }
+            }
+            
+            coalesce_buffer.insert(coalesce_buffer.end(), ptr, ptr + size);
+            if (coalesce_buffer.size() >= opt.coalesce_size)
+            {
+                switch (flush_coalesced())
+                {
+                    case data_action::success:
+                        break;
+                    case data_action::pause:
+                        pause(CURLPAUSE_RECV);
+                        break;
+                    case data_action::abort:
+                    default:
+                        return 0;
+                }
+            }
+            else if (opt.coalesce_timeout_ms > 0)
+                start_coalesce_timer();
+            
+            return size;
+        }
+        
+        data_action::type flush_coalesced()
+        {
+            if (!extras_ || extras_->coalesce_buffer.empty())
+                return data_action::success;
+            
+            data_action::type action = deliver(boost::asio::buffer(extras_->coalesce_buffer));
+            if (action == data_action::success && extras_)
+            {
+                extras_->coalesce_buffer.clear();
+                cancel_coalesce_timer();
+            }
+            return action;
+        }
+        
+        void cancel_coalesce_timer()
+        {
+            if (extras_->coalesce_timer)
+                extras_->coalesce_timer->cancel();
+            extras_->coalesce_timer_armed = false;
+        }
+        
+        void start_coalesce_timer()
+        {
+            extras& ext(get_extras());
+            if (ext.coalesce_timer_armed || !impl_)
+                return;
+            
+            if (!ext.coalesce_timer)
+                ext.coalesce_timer.reset(new boost::asio::deadline_timer(impl_->get_io_service()));
+            
+            ext.coalesce_timer_armed = true;
+            ext.coalesce_timer->expires_from_now(boost::posix_time::milliseconds(opt.coalesce_timeout_ms));
+            ext.coalesce_timer->async_wait(impl_->get_strand().wrap(boost::bind(&transfer::coalesce_timer_handler, shared_from_this(), boost::asio::placeholders::error)));
+        }
+        
+        void coalesce_timer_handler(const boost::system::error_code& err)
+        {
+            if (err || !extras_ || extras_->coalesce_timer->expires_at() > boost::asio::deadline_timer::traits_type::now())
+                return;
+            
+            extras_->coalesce_timer_armed = false;
+            if (!running_ || !impl_ || !on_data_read || paused(CURLPAUSE_RECV))
+                return;
+            
+            switch (flush_coalesced())
+            {
+                case data_action::success:
+                    break;
+                case data_action::pause:
+                    pause(CURLPAUSE_RECV);
+                    break;
+                case data_action::abort:
+                default:
+                    stop();
+                    break;
+            }
+        }
+        
+        void reset_coalesced()
+        {
+            if (!extras_)
+                return;
+            
+            extras_->coalesce_buffer.clear();
+            cancel_coalesce_timer();
+        }
+        
+        static inline size_t curl_write_function(char *ptr, size_t size, size_t nmemb, void *userdata)
+        {
+            CURL_ASIO_LOGSCOPE("transfer::curl_write_function", userdata);
+            return from_ptr(userdata)->write_function(ptr, size * nmemb);
+        }
+        
+        size_t read_function(void *ptr, size_t size)
+        {
+            if (impl_ && on_data_write)
+            {
+                callback_protector protector(callback_recursions_);
+                boost::asio::mutable_buffer buf(ptr, size);
+                data_action::type action = on_data_write(buf);
+                
+                if (!running_)
+                    return CURL_READFUNC_ABORT;
+                
+                switch (action)
+                {
+                    case data_action::success:
+                        return size - boost::asio::buffer_size(buf);
+                    case data_action::pause:
+                        pause_state_ |= CURLPAUSE_SEND;
+                        return CURL_READFUNC_PAUSE;
+                    case data_action::abort:
+                    default:
+                        break;
+                }
+            }
+            
+            return CURL_READFUNC_ABORT;
+        }
+        
+        static inline size_t curl_read_function(void *ptr, size_t size, size_t nmemb, void *userdata)
+        {
+            CURL_ASIO_LOGSCOPE("transfer::curl_read_function", userdata);
+            return from_ptr(userdata)->read_function(ptr, size * nmemb);
+        }
+        
+        size_t header_function(const char *ptr, size_t size)
+        {
+            if (impl_)
+            {
+                if (opt.raw_passthrough)
+                    record_content_encoding(ptr, size);
+                
+                if (on_header)
+                {
+                    callback_protector protector(callback_recursions_);
+                    header_action::type action = on_header(std::string(ptr, size));
+                    
+                    if (!running_)
+                        return 0;
+                    
+                    switch (action)
+                    {
+                        case header_action::success:
+                            return size;
+                        case header_action::abort:
+                        default:
+                            break;
+                    }
+                }
+                else
+                    return size;
+            }
+            
+            return 0;
+        }
+        
+        void record_content_encoding(const char *ptr, size_t size)
+        {
+            static const char status[] = "HTTP/";
+            static const char name[] = "content-encoding:";
+            
+            if (size >= sizeof(status) - 1 && std::memcmp(ptr, status, sizeof(status) - 1) == 0)
+            {
+                if (extras_)
+                    extras_->content_encoding.clear();
+                return;
+            }
+            
+            if (size < sizeof(name) - 1)
+                return;
+            
+            for (size_t i = 0; i < sizeof(name) - 1; ++i)
+            {
+                if (std::tolower(static_cast<unsigned char>(ptr[i])) != name[i])
+                    return;
+            }
+            
+            size_t begin = sizeof(name) - 1;
+            while (begin < size && (ptr[begin] == ' ' || ptr[begin] == '\t'))
+                ++begin;
+            size_t end = size;
+            while (end > begin && std::isspace(static_cast<unsigned char>(ptr[end - 1])))
+                --end;
+            
+            std::string& content_encoding(get_extras().content_encoding);
+            if (!content_encoding.empty())
+                content_encoding += ", ";
+            content_encoding.append(ptr + begin, end - begin);
+        }
+        
+        static inline size_t curl_header_function(void *ptr, size_t size, size_t nmemb, void *userdata)
+        {
+            CURL_ASIO_LOGSCOPE("transfer::curl_header_function", userdata);
+            return from_ptr(userdata)->header_function(static_cast<const char*>(ptr), size * nmemb);
+        }
+        
+#ifdef SO_BUSY_POLL
+        static inline int curl_sockopt_function(void *clientp, curl_socket_t s, curlsocktype purpose)
+        {
+            CURL_ASIO_LOGSCOPE("transfer::curl_sockopt_function", clientp);
+            if (purpose == CURLSOCKTYPE_IPCXN)
+            {
+                int usec = static_cast<int>(static_cast<transfer*>(clientp)->opt.busy_poll_us);
+                ::setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, reinterpret_cast<const char*>(&usec), sizeof(usec));
+            }
+            return CURL_SOCKOPT_OK;
+        }
+#endif
+    };
+    
+    class owned_transfer: private boost::base_from_member<transfer::options>,
+                          public transfer
+    {
+    public:
+        owned_transfer(const passkey& key, boost::shared_ptr<implementation> impl)
+            : boost::base_from_member<transfer::options>(),
+              transfer(key, impl, member)
+        {
+        }
+    };
+    
+    class shared_transfer: public transfer
+    {
+    public:
+        typedef boost::shared_ptr<shared_transfer> ptr;
+        
+        shared_transfer(const passkey& key, boost::shared_ptr<implementation> impl, boost::shared_ptr<const options> profile)
+            : transfer(key, impl, const_cast<options&>(*profile), profile),
+              opt(*profile)
+        {
+        }
+        
+        const options& opt;
+    };
+    
+    class memory_budget: public boost::enable_shared_from_this<memory_budget>,
+                         private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<memory_budget> ptr;
+        typedef boost::shared_ptr< const std::vector<char> > chunk_ptr;
+        
+        struct stats
+        {
+            std::size_t limit;
+            std::size_t used;
+            std::size_t peak;
+            std::size_t waiting;
+            unsigned long pauses;
+            unsigned long resumes;
+            boost::posix_time::time_duration paused_time;
+            
+            stats()
+                : limit(0),
+                  used(0),
+                  peak(0),
+                  waiting(0),
+                  pauses(0),
+                  resumes(0)
+            {
+            }
+        };
+        
+        class account: public boost::enable_shared_from_this<account>,
+                       private boost::noncopyable
+        {
+        public:
+            typedef boost::shared_ptr<account> ptr;
+            
+            ~account()
+            {
+                budget_->release(held_.exchange(0));
+            }
+            
+            bool admit()
+            {
+                if (held_ == 0 || !budget_->exceeded())
+                    return true;
+                
+                transfer::ptr trans(transfer_.lock());
+                if (trans)
+                {
+                    if (!hooked_)
+                    {
+                        hooked_ = true;
+                        trans->add_done_hook(boost::bind(&account::transfer_done, shared_from_this(), _1));
+                    }
+                    budget_->wait(trans);
+                }
+                return false;
+            }
+            
+            void charge(std::size_t bytes)
+            {
+                held_ += bytes;
+                budget_->charge(bytes);
+            }
+            
+            void release(std::size_t bytes)
+            {
+                held_ -= bytes;
+                budget_->release(bytes);
+            }
+            
+            chunk_ptr make_chunk(const char *data, std::size_t size)
+            {
+                charge(size);
+                return chunk_ptr(new std::vector<char>(data, data + size), chunk_release(shared_from_this()));
+            }
+            
+            std::size_t held() const { return held_; }
+            
+        private:
+            friend class memory_budget;
+            
+            struct chunk_release
+            {
+                ptr owner;
+                
+                explicit chunk_release(const ptr& o)
+                    : owner(o)
+                {
+                }
+                
+                void operator()(const std::vector<char> *chunk) const
+                {
+                    owner->release(chunk->size());
+                    delete chunk;
+                }
+            };
+            
+            memory_budget::ptr budget_;
+            boost::weak_ptr<transfer> transfer_;
+            boost::atomic<std::size_t> held_;
+            bool hooked_;
+            
+            account(memory_budget::ptr budget, transfer::ptr trans)
+                : budget_(budget),
+                  transfer_(trans),
+                  held_(0),
+                  hooked_(false)
+            {
+            }
+            
+            void transfer_done(CURLcode)
+            {
+                hooked_ = false;
+                budget_->forget(transfer_.lock());
+            }
+        };
+        
+        account::ptr open(transfer::ptr trans)
+        {
+            return account::ptr(new account(shared_from_this(), trans));
+        }
+        
+        void set_limit(std::size_t bytes)
+        {
+            limit_ = bytes;
+            schedule();
+        }
+        
+        std::size_t limit() const { return limit_; }
+        
+        std::size_t used() const { return used_; }
+        
+        bool exceeded() const
+        {
+            std::size_t limit = limit_;
+            return limit > 0 && used_ >= limit;
+        }
+        
+        stats get_stats() const
+        {
+            stats ret;
+            ret.limit = limit_;
+            ret.used = used_;
+            ret.peak = peak_;
+            ret.waiting = waiting_;
+            ret.pauses = pauses_;
+            ret.resumes = resumes_;
+            ret.paused_time = boost::posix_time::microseconds(paused_us_.load());
+            return ret;
+        }
+        
+    private:
+        friend class implementation;
+        
+        typedef std::pair<int, unsigned long> waiter_key;
+        
+        struct waiter_order
+        {
+            bool operator()(const waiter_key& a, const waiter_key& b) const
+            {
+                return a.first != b.first ? a.first > b.first : a.second < b.second;
+            }
+        };
+        
+        struct waiter
+        {
+            const transfer *owner;
+            boost::weak_ptr<transfer> trans;
+            boost::posix_time::ptime since;
+        };
+        
+        typedef std::map<waiter_key, waiter, waiter_order> waiter_map;
+        typedef std::map<const transfer*, waiter_map::iterator> waiter_index;
+        
+        boost::asio::io_service::strand strand_;
+        boost::scoped_ptr<boost::asio::io_service::work> work_;
+        boost::atomic<std::size_t> limit_;
+        boost::atomic<std::size_t> used_;
+        boost::atomic<std::size_t> peak_;
+        boost::atomic<std::size_t> waiting_;
+        boost::atomic<unsigned long> pauses_;
+        boost::atomic<unsigned long> resumes_;
+        boost::atomic<boost::int64_t> paused_us_;
+        boost::atomic<bool> scheduled_;
+        unsigned long sequence_;
+        waiter_map waiters_;
+        waiter_index index_;
+        
+        explicit memory_budget(boost::asio::io_service::strand& strand)
+            : strand_(strand),
+              limit_(0),
+              used_(0),
+              peak_(0),
+              waiting_(0),
+              pauses_(0),
+              resumes_(0),
+              paused_us_(0),
+              scheduled_(false),
+              sequence_(0)
+        {
+        }
+        
+        void charge(std::size_t bytes)
+        {
+            std::size_t used = used_ += bytes;
+            std::size_t peak = peak_;
+            while (used > peak && !peak_.compare_exchange_weak(peak, used))
+                ;
+        }
+        
+        void release(std::size_t bytes)
+        {
+            if (!bytes)
+                return;
+            
+            used_ -= bytes;
+            if (waiting_ > 0 && !exceeded())
+                schedule();
+        }
+        
+        void schedule()
+        {
+            if (!scheduled_.exchange(true))
+                strand_.post(boost::bind(&memory_budget::resume_waiters, shared_from_this()));
+        }
+        
+        void wait(transfer::ptr trans)
+        {
+            waiter_index::iterator it(index_.find(trans.get()));
+            if (it != index_.end())
+            {
+                if (it->second->second.trans.lock() == trans)
+                    return;
+                finish_wait(it);
+            }
+            
+            waiter w;
+            w.owner = trans.get();
+            w.trans = trans;
+            w.since = boost::posix_time::microsec_clock::universal_time();
+            index_[trans.get()] = waiters_.insert(std::make_pair(waiter_key(trans->opt.budget_priority, sequence_++), w)).first;
+            waiting_ = waiters_.size();
+            ++pauses_;
+            
+            if (!work_)
+                work_.reset(new boost::asio::io_service::work(io_service_of(strand_)));
+        }
+        
+        void forget(transfer::ptr trans)
+        {
+            if (!trans)
+                return;
+            
+            waiter_index::iterator it(index_.find(trans.get()));
+            if (it != index_.end())
+                finish_wait(it);
+            idle();
+        }
+        
+        transfer::ptr finish_wait(waiter_index::iterator it)
+        {
+            waiter_map::iterator w(it->second);
+            transfer::ptr trans(w->second.trans.lock());
+            boost::posix_time::time_duration paused(boost::posix_time::microsec_clock::universal_time() - w->second.since);
+            paused_us_ += paused.total_microseconds();
+            if (trans)
+                trans->get_extras().budget_paused += paused;
+            
+            index_.erase(it);
+            waiters_.erase(w);
+            waiting_ = waiters_.size();
+            return trans;
+        }
+        
+        void resume_waiters()
+        {
+            scheduled_ = false;
+            
+            while (!exceeded() && !waiters_.empty())
+            {
+                transfer::ptr trans(finish_wait(index_.find(waiters_.begin()->second.owner)));
+                if (!trans || !trans->running_)
+                    continue;
+                
+                ++resumes_;
+                trans->do_resume(CURLPAUSE_RECV);
+            }
+            idle();
+        }
+        
+        void idle()
+        {
+            if (waiters_.empty())
+                work_.reset();
+        }
+    };
+    
+    class upload_stream: private boost::noncopyable
+    {
+        typedef boost::function<void(const boost::system::error_code&, std::size_t)> write_handler;
+        
+        class state: public boost::enable_shared_from_this<state>,
+                     private boost::noncopyable
+        {
+        public:
+            state(transfer::ptr trans)
+                : transfer_(trans),
+                  io_(trans->impl_->get_io_service()),
+                  strand_(trans->impl_->get_strand()),
+                  current_(0),
+                  transferred_(0),
+                  pending_(false),
+                  closed_(false),
+                  detached_(false),
+                  finished_(false),
+                  hooked_(false)
+            {
+            }
+            
+            boost::asio::io_service& get_io_service() { return io_; }
+            
+            template <typename ConstBufferSequence>
+            void write(const ConstBufferSequence& buffers, const write_handler& handler)
+            {
+                if (pending_)
+                {
+                    strand_.post(boost::bind(handler, boost::asio::error::in_progress, 0));
+                    return;
+                }
+                
+                transfer::ptr trans(transfer_.lock());
+                if (finished_ || closed_ || !trans)
+                {
+                    strand_.post(boost::bind(handler, boost::asio::error::broken_pipe, 0));
+                    return;
+                }
+                
+                buffers_.clear();
+                for (typename ConstBufferSequence::const_iterator it(buffers.begin()); it != buffers.end(); ++it)
+                {
+                    boost::asio::const_buffer buf(*it);
+                    if (boost::asio::buffer_size(buf) > 0)
+                        buffers_.push_back(buf);
+                }
+                
+                if (buffers_.empty())
+                {
+                    strand_.post(boost::bind(handler, boost::system::error_code(), 0));
+                    return;
+                }
+                
+                current_ = 0;
+                transferred_ = 0;
+                handler_ = handler;
+                pending_ = true;
+                hook(trans);
+                trans->resume(CURLPAUSE_SEND);
+            }
+            
+            void close()
+            {
+                if (closed_)
+                    return;
+                
+                closed_ = true;
+                transfer::ptr trans(transfer_.lock());
+                if (trans)
+                    trans->resume(CURLPAUSE_SEND);
+            }
+            
+            void detach()
+            {
+                detached_ = true;
+                complete(boost::asio::error::operation_aborted);
+            }
+            
+            data_action::type read(boost::asio::mutable_buffer& buf)
+            {
+                if (detached_)
+                    return data_action::abort;
+                
+                if (!pending_)
+                    return closed_ ? data_action::success : data_action::pause;
+                
+                while (current_ < buffers_.size() && boost::asio::buffer_size(buf) > 0)
+                {
+                    std::size_t n = boost::asio::buffer_copy(buf, buffers_[current_]);
+                    buf = buf + n;
+                    buffers_[current_] = buffers_[current_] + n;
+                    transferred_ += n;
+                    if (boost::asio::buffer_size(buffers_[current_]) == 0)
+                        ++current_;
+                }
+                
+                if (current_ == buffers_.size())
+                    complete(boost::system::error_code());
+                
+                return data_action::success;
+            }
+            
+        private:
+            boost::weak_ptr<transfer> transfer_;
+            boost::asio::io_service& io_;
+            boost::asio::io_service::strand strand_;
+            std::vector<boost::asio::const_buffer> buffers_;
+            std::size_t current_;
+            std::size_t transferred_;
+            write_handler handler_;
+            bool pending_;
+            bool closed_;
+            bool detached_;
+            bool finished_;
+            bool hooked_;
+            
+            void hook(transfer::ptr trans)
+            {
+                if (hooked_)
+                    return;
+                
+                hooked_ = true;
+                trans->add_done_hook(boost::bind(&state::handle_done, shared_from_this(), _1));
+            }
+            
+            void handle_done(CURLcode)
+            {
+                hooked_ = false;
+                finished_ = true;
+                complete(boost::asio::error::operation_aborted);
+            }
+            
+            void complete(const boost::system::error_code& err)
+            {
+                if (!pending_)
+                    return;
+                
+                pending_ = false;
+                buffers_.clear();
+                strand_.post(boost::bind(handler_, err, transferred_));
+                handler_.clear();
+            }
+        };
+        
+    public:
+#if BOOST_VERSION >= 106600
+        typedef boost::asio::io_service::executor_type executor_type;
+        
+        executor_type get_executor() { return state_->get_io_service().get_executor(); }
+#endif
+        
+        explicit upload_stream(transfer::ptr trans)
+            : state_(new state(trans))
+        {
+            trans->on_data_write = boost::bind(&state::read, state_, _1);
+        }
+        
+        ~upload_stream()
+        {
+            state_->detach();
+        }
+        
+        boost::asio::io_service& get_io_service() { return state_->get_io_service(); }
+        
+        template <typename ConstBufferSequence, typename WriteHandler>
+        void async_write_some(const ConstBufferSequence& buffers, WriteHandler handler)
+        {
+            state_->write(buffers, write_handler(handler));
+        }
+        
+        void close()
+        {
+            state_->close();
+        }
+        
+    private:
+        boost::shared_ptr<state> state_;
+    };
+    
+#if defined(CURL_ASIO_ENABLE_ZLIB) || defined(CURL_ASIO_ENABLE_ZSTD)
+    class body_compressor: public boost::enable_shared_from_this<body_compressor>,
+                           private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<body_compressor> ptr;
+        
+        struct encoding
+        {
+            typedef enum
+            {
+                gzip,
+                zstd
+            } type;
+        };
+        
+        static inline ptr create(transfer::ptr trans, encoding::type enc = encoding::gzip, int level = 1, std::size_t buffer_size = 64 * 1024)
+        {
+            if (trans->shares_options())
+                return ptr();
+            
+            ptr compressor(new body_compressor(trans->on_data_write, enc, buffer_size));
+            if (!compressor->init(level))
+                return ptr();
+            
+            trans->on_data_write = boost::bind(&body_compressor::read, compressor, _1);
+            trans->opt.http_header.push_back(enc == encoding::zstd ? "Content-Encoding: zstd" : "Content-Encoding: gzip");
+            trans->opt.upload_size = -1;
+            return compressor;
+        }
+        
+        ~body_compressor()
+        {
+#ifdef CURL_ASIO_ENABLE_ZLIB
+            if (zlib_init_)
+                ::deflateEnd(&zlib_);
+#endif
+#ifdef CURL_ASIO_ENABLE_ZSTD
+            if (zstd_)
+                ::ZSTD_freeCCtx(zstd_);
+#endif
+        }
+        
+        curl_off_t bytes_in() const { return bytes_in_; }
+        
+        curl_off_t bytes_out() const { return bytes_out_; }
+        
+    private:
+        struct flush_mode
+        {
+            typedef enum
+            {
+                none,
+                sync,
+                finish
+            } type;
+        };
+        
+        transfer::data_write_handler source_;
+        const encoding::type encoding_;
+        std::vector<char> input_;
+        std::size_t input_pos_;
+        std::size_t input_len_;
+        bool eof_;
+        bool finished_;
+        bool unflushed_;
+        curl_off_t bytes_in_;
+        curl_off_t bytes_out_;
+#ifdef CURL_ASIO_ENABLE_ZLIB
+        z_stream zlib_;
+        bool zlib_init_;
+#endif
+#ifdef CURL_ASIO_ENABLE_ZSTD
+        ZSTD_CCtx *zstd_;
+#endif
+        
+        body_compressor(const transfer::data_write_handler& source, encoding::type enc, std::size_t buffer_size)
+            : source_(source),
+              encoding_(enc),
+              input_(buffer_size),
+              input_pos_(0),
+              input_len_(0),
+              eof_(false),
+              finished_(false),
+              unflushed_(false),
+              bytes_in_(0),
+              bytes_out_(0)
+#ifdef CURL_ASIO_ENABLE_ZLIB
+              , zlib_init_(false)
+#endif
+#ifdef CURL_ASIO_ENABLE_ZSTD
+              , zstd_(NULL)
+#endif
+        {
+        }
+        
+        bool init(int level)
+        {
+            if (!source_ || input_.empty())
+                return false;
+            
+            switch (encoding_)
+            {
+#ifdef CURL_ASIO_ENABLE_ZLIB
+                case encoding::gzip:
+                    std::memset(&zlib_, 0, sizeof(zlib_));
+                    zlib_init_ = ::deflateInit2(&zlib_, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+                    return zlib_init_;
+#endif
+#ifdef CURL_ASIO_ENABLE_ZSTD
+                case encoding::zstd:
+                    zstd_ = ::ZSTD_createCCtx();
+                    return zstd_ && !::ZSTD_isError(::ZSTD_CCtx_setParameter(zstd_, ZSTD_c_compressionLevel, level));
+#endif
+                default:
+                    return false;
+            }
+        }
+        
+        data_action::type read(boost::asio::mutable_buffer& buf)
+        {
+            std::size_t size = boost::asio::buffer_size(buf);
+            while (boost::asio::buffer_size(buf) > 0 && !finished_)
+            {
+                flush_mode::type mode = eof_ ? flush_mode::finish : flush_mode::none;
+                if (input_pos_ == input_len_ && !eof_)
+                {
+                    boost::asio::mutable_buffer in(boost::asio::buffer(input_));
+                    data_action::type action = source_(in);
+                    if (action == data_action::pause)
+                    {
+                        if (boost::asio::buffer_size(buf) < size)
+                            break;
+                        if (!unflushed_)
+                            return data_action::pause;
+                        mode = flush_mode::sync;
+                    }
+                    else if (action != data_action::success)
+                        return data_action::abort;
+                    else
+                    {
+                        input_pos_ = 0;
+                        input_len_ = input_.size() - boost::asio::buffer_size(in);
+                        bytes_in_ += input_len_;
+                        if (input_len_ > 0)
+                            unflushed_ = true;
+                        else
+                        {
+                            eof_ = true;
+                            mode = flush_mode::finish;
+                        }
+                    }
+                }
+                
+                bool flushed = false;
+                int rc = compress(buf, mode, flushed);
+                if (rc < 0)
+                    return data_action::abort;
+                else if (rc > 0)
+                    finished_ = true;
+                
+                if (mode == flush_mode::sync)
+                {
+                    unflushed_ = !flushed;
+                    if (boost::asio::buffer_size(buf) == size)
+                        return data_action::pause;
+                    break;
+                }
+            }
+            
+            bytes_out_ += size - boost::asio::buffer_size(buf);
+            return data_action::success;
+        }
+        
+        int compress(boost::asio::mutable_buffer& buf, flush_mode::type mode, bool& flushed)
+        {
+            const char *in = &input_[0] + input_pos_;
+            std::size_t in_len = input_len_ - input_pos_;
+            char *out = boost::asio::buffer_cast<char*>(buf);
+            std::size_t out_len = boost::asio::buffer_size(buf);
+            
+            switch (encoding_)
+            {
+#ifdef CURL_ASIO_ENABLE_ZLIB
+                case encoding::gzip:
+                {
+                    zlib_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+                    zlib_.avail_in = static_cast<uInt>(in_len);
+                    zlib_.next_out = reinterpret_cast<Bytef*>(out);
+                    zlib_.avail_out = static_cast<uInt>(out_len);
+                    int rc = ::deflate(&zlib_, mode == flush_mode::finish ? Z_FINISH : (mode == flush_mode::sync ? Z_SYNC_FLUSH : Z_NO_FLUSH));
+                    if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+                        return -1;
+                    
+                    input_pos_ += in_len - zlib_.avail_in;
+                    buf = buf + (out_len - zlib_.avail_out);
+                    flushed = zlib_.avail_out > 0;
+                    return rc == Z_STREAM_END ? 1 : 0;
+                }
+#endif
+#ifdef CURL_ASIO_ENABLE_ZSTD
+                case encoding::zstd:
+                {
+                    ZSTD_inBuffer input = { in, in_len, 0 };
+                    ZSTD_outBuffer output = { out, out_len, 0 };
+                    std::size_t remaining = ::ZSTD_compressStream2(zstd_, &output, &input, mode == flush_mode::finish ? ZSTD_e_end : (mode == flush_mode::sync ? ZSTD_e_flush : ZSTD_e_continue));
+                    if (::ZSTD_isError(remaining))
+                        return -1;
+                    
+                    input_pos_ += input.pos;
+                    buf = buf + output.pos;
+                    flushed = remaining == 0;
+                    return mode == flush_mode::finish && remaining == 0 ? 1 : 0;
+                }
+#endif
+                default:
+                    return -1;
+            }
+        }
+    };
+#endif
+    
+    template <typename AsyncWriteStream>
+    class relay: public boost::enable_shared_from_this< relay<AsyncWriteStream> >,
+                 private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<relay> ptr;
+        typedef boost::function<void(CURLcode, const boost::system::error_code&)> done_handler;
+        
+        static inline ptr create(transfer::ptr trans, AsyncWriteStream& downstream, std::size_t max_buffered = 256 * 1024, std::size_t chunk_size = 16 * 1024)
+        {
+            ptr r(new relay(trans, downstream, max_buffered, chunk_size));
+            trans->on_data_read = boost::bind(&relay::data_read, r, _1);
+            trans->add_done_hook(boost::bind(&relay::upstream_done, r, _1));
+            return r;
+        }
+        
+        done_handler on_done;
+        
+        void pause()
+        {
+            paused_ = true;
+            transfer::ptr trans(transfer_.lock());
+            if (trans)
+                trans->pause(CURLPAUSE_RECV);
+        }
+        
+        void resume()
+        {
+            if (!paused_)
+                return;
+            
+            paused_ = false;
+            start_write();
+            resume_upstream();
+        }
+        
+        std::size_t buffered() const { return buffered_; }
+        
+        bool paused() const { return paused_; }
+        
+    private:
+        typedef std::vector<char> chunk;
+        typedef boost::shared_ptr<chunk> chunk_ptr;
+        
+        enum { max_gather = 64 };
+        
+        boost::weak_ptr<transfer> transfer_;
+        boost::asio::io_service::strand strand_;
+        AsyncWriteStream& downstream_;
+        const std::size_t max_buffered_;
+        const std::size_t chunk_size_;
+        std::size_t buffered_;
+        std::list<chunk_ptr> queue_;
+        std::vector<chunk_ptr> free_;
+        std::vector<boost::asio::const_buffer> gather_;
+        std::size_t in_flight_;
+        memory_budget::account::ptr account_;
+        bool paused_;
+        bool upstream_done_;
+        bool finished_;
+        CURLcode result_;
+        boost::system::error_code error_;
+        
+        relay(transfer::ptr trans, AsyncWriteStream& downstream, std::size_t max_buffered, std::size_t chunk_size)
+            : transfer_(trans),
+              strand_(trans->impl_->get_strand()),
+              downstream_(downstream),
+              max_buffered_(max_buffered),
+              chunk_size_(chunk_size),
+              buffered_(0),
+              in_flight_(0),
+              account_(trans->impl_->get_budget().open(trans)),
+              paused_(false),
+              upstream_done_(false),
+              finished_(false),
+              result_(CURLE_OK)
+        {
+        }
+        
+        data_action::type data_read(const boost::asio::const_buffer& buffer)
+        {
+            if (finished_)
+                return data_action::abort;
+            
+            const char *data = boost::asio::buffer_cast<const char*>(buffer);
+            std::size_t size = boost::asio::buffer_size(buffer);
+            if (paused_ || (buffered_ > 0 && buffered_ + size > max_buffered_) || !account_->admit())
+            {
+                return data_action::pause;
+            }
+            
+            if (queue_.size() > in_flight_ && queue_.back()->size() + size <= chunk_size_)
+                queue_.back()->insert(queue_.back()->end(), data, data + size);
+            else
+            {
+                chunk_ptr c;
+                if (free_.empty())
+                    c.reset(new chunk);
+                else
+                {
+                    c = free_.back();
+                    free_.pop_back();
+                }
+                c->assign(data, data + size);
+                queue_.push_back(c);
+            }
+            
+            buffered_ += size;
+            account_->charge(size);
+            start_write();
+            return data_action::success;
+        }
+        
+        void start_write()
+        {
+            if (in_flight_ > 0 || paused_ || queue_.empty())
+                return;
+            
+            gather_.clear();
+            for (typename std::list<chunk_ptr>::const_iterator it(queue_.begin()); it != queue_.end() && gather_.size() < max_gather; ++it)
+                gather_.push_back(boost::asio::buffer(**it));
+            in_flight_ = gather_.size();
+            
+            boost::asio::async_write(downstream_, gather_, strand_.wrap(boost::bind(&relay::write_complete, this->shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+        }
+        
+        void write_complete(const boost::system::error_code& err, std::size_t bytes_transferred)
+        {
+            for (; in_flight_ > 0; --in_flight_)
+            {
+                chunk_ptr c(queue_.front());
+                queue_.pop_front();
+                c->clear();
+                if (c->capacity() <= chunk_size_)
+                    free_.push_back(c);
+            }
+            buffered_ -= bytes_transferred;
+            account_->release(bytes_transferred);
+            
+            if (err)
+            {
+                queue_.clear();
+                account_->release(buffered_);
+                buffered_ = 0;
+                error_ = err;
+                transfer::ptr trans(transfer_.lock());
+                if (trans)
+                    trans->stop();
+                finish(err);
+                return;
+            }
+            
+            start_write();
+            resume_upstream();
+            
+            if (upstream_done_ && queue_.empty())
+                finish(boost::system::error_code());
+        }
+        
+        void resume_upstream()
+        {
+            if (paused_ || buffered_ > max_buffered_ / 2)
+                return;
+            
+            transfer::ptr trans(transfer_.lock());
+            if (trans && trans->paused(CURLPAUSE_RECV))
+            {
+                trans->resume(CURLPAUSE_RECV);
+            }
+        }
+        
+        void upstream_done(CURLcode result)
+        {
+            upstream_done_ = true;
+            result_ = result;
+            if (queue_.empty())
+                finish(error_);
+        }
+        
+        void finish(const boost::system::error_code& err)
+        {
+            if (finished_)
+                return;
+            
+            finished_ = true;
+            if (on_done)
+                on_done(result_, err);
+        }
+    };
+    
+    class tee: public boost::enable_shared_from_this<tee>,
+               private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<tee> ptr;
+        typedef boost::shared_ptr< const std::vector<char> > chunk_ptr;
+        typedef boost::function<bool(const chunk_ptr&)> chunk_handler;
+        typedef boost::function<void(CURLcode)> done_handler;
+        
+        struct lag_policy
+        {
+            typedef enum
+            {
+                backpressure,
+                detach
+            } type;
+        };
+        
+        static inline ptr create(transfer::ptr trans, std::size_t max_lag = 1024 * 1024, lag_policy::type policy = lag_policy::backpressure)
+        {
+            ptr t(new tee(trans, max_lag, policy));
+            trans->on_data_read = boost::bind(&tee::data_read, t, _1);
+            trans->add_done_hook(boost::bind(&tee::upstream_done, t, _1));
+            return t;
+        }
+        
+        std::size_t add_consumer(const chunk_handler& on_chunk, const done_handler& on_done = done_handler())
+        {
+            consumers_.push_back(consumer());
+            consumers_.back().on_chunk = on_chunk;
+            consumers_.back().on_done = on_done;
+            return consumers_.size() - 1;
+        }
+        
+        void consumed(std::size_t id)
+        {
+            if (id >= consumers_.size() || consumers_[id].outstanding.empty())
+                return;
+            
+            consumer& c(consumers_[id]);
+            c.lag -= c.outstanding.front()->size();
+            c.outstanding.pop_front();
+            resume_upstream();
+        }
+        
+        void detach(std::size_t id)
+        {
+            if (id < consumers_.size())
+                detach(consumers_[id], CURLE_WRITE_ERROR);
+        }
+        
+        std::size_t lag(std::size_t id) const
+        {
+            return id < consumers_.size() ? consumers_[id].lag : 0;
+        }
+        
+        bool attached(std::size_t id) const
+        {
+            return id < consumers_.size() && consumers_[id].attached;
+        }
+        
+    private:
+        struct consumer
+        {
+            chunk_handler on_chunk;
+            done_handler on_done;
+            std::list<chunk_ptr> outstanding;
+            std::size_t lag;
+            bool attached;
+            
+            consumer()
+                : lag(0),
+                  attached(true)
+            {
+            }
+        };
+        
+        boost::weak_ptr<transfer> transfer_;
+        const std::size_t max_lag_;
+        const lag_policy::type policy_;
+        std::vector<consumer> consumers_;
+        memory_budget::account::ptr account_;
+        
+        tee(transfer::ptr trans, std::size_t max_lag, lag_policy::type policy)
+            : transfer_(trans),
+              max_lag_(max_lag),
+              policy_(policy),
+              account_(trans->impl_->get_budget().open(trans))
+        {
+        }
+        
+        std::size_t max_lag() const
+        {
+            std::size_t ret = 0;
+            for (std::vector<consumer>::const_iterator it(consumers_.begin()); it != consumers_.end(); ++it)
+            {
+                if (it->attached && it->lag > ret)
+                    ret = it->lag;
+            }
+            return ret;
+        }
+        
+        bool any_attached() const
+        {
+            for (std::vector<consumer>::const_iterator it(consumers_.begin()); it != consumers_.end(); ++it)
+            {
+                if (it->attached)
+                    return true;
+            }
+            return false;
+        }
+        
+        data_action::type data_read(const boost::asio::const_buffer& buffer)
+        {
+            const char *data = boost::asio::buffer_cast<const char*>(buffer);
+            std::size_t size = boost::asio::buffer_size(buffer);
+            
+            if (!any_attached())
+                return data_action::success;
+            
+            if ((policy_ == lag_policy::backpressure && max_lag() >= max_lag_) || !account_->admit())
+                return data_action::pause;
+            
+            chunk_ptr chunk(account_->make_chunk(data, size));
+            for (std::size_t id = 0; id < consumers_.size(); ++id)
+            {
+                if (!consumers_[id].attached)
+                    continue;
+                
+                if (policy_ == lag_policy::detach && consumers_[id].lag > 0 && consumers_[id].lag + size > max_lag_)
+                {
+                    detach(consumers_[id], CURLE_WRITE_ERROR);
+                    continue;
+                }
+                
+                consumers_[id].outstanding.push_back(chunk);
+                consumers_[id].lag += size;
+                chunk_handler on_chunk(consumers_[id].on_chunk);
+                if (on_chunk(chunk) && consumers_[id].attached && !consumers_[id].outstanding.empty() && consumers_[id].outstanding.back() == chunk)
+                {
+                    consumers_[id].outstanding.pop_back();
+                    consumers_[id].lag -= size;
+                }
+            }
+            
+            return data_action::success;
+        }
+        
+        void resume_upstream()
+        {
+            if (policy_ != lag_policy::backpressure || max_lag() > max_lag_ / 2)
+                return;
+            
+            transfer::ptr trans(transfer_.lock());
+            if (trans && trans->paused(CURLPAUSE_RECV))
+                trans->resume(CURLPAUSE_RECV);
+        }
+        
+        void detach(consumer& c, CURLcode result)
+        {
+            if (!c.attached)
+                return;
+            
+            c.attached = false;
+            c.outstanding.clear();
+            c.lag = 0;
+            done_handler on_done(c.on_done);
+            c.on_done.clear();
+            c.on_chunk.clear();
+            if (on_done)
+                on_done(result);
+            resume_upstream();
+        }
+        
+        void upstream_done(CURLcode result)
+        {
+            for (std::size_t id = 0; id < consumers_.size(); ++id)
+            {
+                if (!consumers_[id].attached)
+                    continue;
+                
+                done_handler on_done(consumers_[id].on_done);
+                if (on_done)
+                    on_done(result);
+            }
+        }
+    };
+    
+    class body_collector: public boost::enable_shared_from_this<body_collector>,
+                          private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<body_collector> ptr;
+        typedef boost::function<void(CURLcode, const boost::asio::const_buffer&)> done_handler;
+        
+        static inline ptr create(transfer::ptr trans, std::size_t memory_limit = 1024 * 1024, const std::string &temp_dir = std::string())
+        {
+            ptr collector(new body_collector(trans, memory_limit, temp_dir));
+            trans->on_data_read = boost::bind(&body_collector::data_read, collector, _1);
+            trans->add_done_hook(boost::bind(&body_collector::upstream_done, collector, _1));
+            return collector;
+        }
+        
+        virtual ~body_collector()
+        {
+            if (map_)
+                ::munmap(map_, size_);
+            if (fd_ >= 0)
+                ::close(fd_);
+        }
+        
+        done_handler on_done;
+        
+        boost::asio::const_buffer body() const
+        {
+            if (map_)
+                return boost::asio::const_buffer(map_, size_);
+            return boost::asio::buffer(memory_);
+        }
+        
+        std::size_t size() const { return size_; }
+        
+        bool spilled() const { return spilled_; }
+        
+        int error() const { return error_; }
+        
+    private:
+        enum
+        {
+            spill_chunk_size = 64 * 1024
+        };
+        
+        boost::weak_ptr<transfer> transfer_;
+        const std::size_t memory_limit_;
+        std::string temp_dir_;
+        std::vector<char> memory_;
+        memory_budget::account::ptr account_;
+        std::size_t size_;
+        void *map_;
+        int fd_;
+        int error_;
+        bool spilled_;
+        
+        body_collector(transfer::ptr trans, std::size_t memory_limit, const std::string &temp_dir)
+            : transfer_(trans),
+              memory_limit_(memory_limit),
+              temp_dir_(temp_dir),
+              account_(trans->impl_->get_budget().open(trans)),
+              size_(0),
+              map_(NULL),
+              fd_(-1),
+              error_(0),
+              spilled_(false)
+        {
+            if (temp_dir_.empty())
+            {
+                const char *env = std::getenv("TMPDIR");
+                temp_dir_ = env && *env ? env : "/tmp";
+            }
+        }
+        
+        data_action::type data_read(const boost::asio::const_buffer& buffer)
+        {
+            const char *data = boost::asio::buffer_cast<const char*>(buffer);
+            std::size_t size = boost::asio::buffer_size(buffer);
+            
+            if (!spilled_ && size_ + size > memory_limit_ && !spill())
+                return data_action::abort;
+            
+            if (spilled_ && memory_.size() + size > spill_chunk_size && !flush())
+                return data_action::abort;
+            
+            if (spilled_ && size > spill_chunk_size)
+            {
+                if (!write_all(data, size))
+                    return data_action::abort;
+            }
+            else
+            {
+                memory_.insert(memory_.end(), data, data + size);
+                account_->charge(size);
+            }
+            
+            size_ += size;
+            return data_action::success;
+        }
+        
+        bool spill()
+        {
+            std::vector<char> path(temp_dir_.begin(), temp_dir_.end());
+            static const char name[] = "/curl_asio.XXXXXX";
+            path.insert(path.end(), name, name + sizeof(name));
+            
+            fd_ = ::mkstemp(&path[0]);
+            if (fd_ < 0)
+            {
+                error_ = errno;
+                return false;
+            }
+            
+            ::unlink(&path[0]);
+            spilled_ = true;
+            if (!flush())
+                return false;
+            
+            std::vector<char>().swap(memory_);
+            memory_.reserve(spill_chunk_size);
+            return true;
+        }
+        
+        bool flush()
+        {
+            if (memory_.empty())
+                return true;
+            
+            bool ok = write_all(&memory_[0], memory_.size());
+            account_->release(memory_.size());
+            memory_.clear();
+            return ok;
+        }
+        
+        bool write_all(const char *data, std::size_t size)
+        {
+            while (size > 0)
+            {
+                ssize_t n = ::write(fd_, data, size);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    error_ = errno;
+                    return false;
+                }
+                data += n;
+                size -= n;
+            }
+            return true;
+        }
+        
+        void upstream_done(CURLcode result)
+        {
+            transfer::ptr trans(transfer_.lock());
+            if (trans)
+                trans->on_data_read.clear();
+            
+            if (spilled_ && (!flush() || !map_file()) && result == CURLE_OK)
+                result = CURLE_WRITE_ERROR;
+            
+            if (on_done)
+                on_done(result, body());
+        }
+        
+        bool map_file()
+        {
+            void *map = ::mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (map == MAP_FAILED)
+            {
+                error_ = errno;
+                return false;
+            }
+            
+            map_ = map;
+            ::close(fd_);
+            fd_ = -1;
+            return true;
+        }
+    };
+    
+    class slab_arena: public boost::enable_shared_from_this<slab_arena>,
+                      private boost::noncopyable
+    {
+        struct slab;
+        
+    public:
+        typedef boost::shared_ptr<slab_arena> ptr;
+        
+        struct view
+        {
+            const char *data;
+            std::size_t size;
+            
+            view()
+                : data(NULL),
+                  size(0)
+            {
+            }
+            
+            view(const char *d, std::size_t s)
+                : data(d),
+                  size(s)
+            {
+            }
+            
+            boost::asio::const_buffer buffer() const { return boost::asio::const_buffer(data, size); }
+            
+            std::string str() const { return std::string(data, size); }
+            
+            bool empty() const { return size == 0; }
+        };
+        
+        typedef boost::function<void(CURLcode, const view&)> done_handler;
+        
+        static inline ptr create(std::size_t slab_size = 256 * 1024, std::size_t max_reserve = 16 * 1024 * 1024)
+        {
+            return ptr(new slab_arena(slab_size, max_reserve));
+        }
+        
+        virtual ~slab_arena()
+        {
+            for (std::vector<slab*>::const_iterator it(active_.begin()); it != active_.end(); ++it)
+                destroy(*it);
+            for (std::vector<slab*>::const_iterator it(free_.begin()); it != free_.end(); ++it)
+                destroy(*it);
+        }
+        
+        void collect(transfer::ptr trans, const done_handler& handler)
+        {
+            collector_binding binding(boost::allocate_shared<collector>(pool_allocator::allocator<collector>(), shared_from_this(), trans, handler));
+            trans->on_data_read = binding;
+            trans->add_done_hook(binding);
+        }
+        
+        view store(const char *data, std::size_t size)
+        {
+            slab *s = NULL;
+            char *p = allocate(size, s);
+            std::memcpy(p, data, size);
+            return view(p, size);
+        }
+        
+        void release()
+        {
+            std::vector<slab*> kept;
+            for (std::vector<slab*>::const_iterator it(active_.begin()); it != active_.end(); ++it)
+            {
+                if ((*it)->pins > 0)
+                    kept.push_back(*it);
+                else if ((*it)->size == slab_size_)
+                {
+                    (*it)->used = 0;
+                    free_.push_back(*it);
+                }
+                else
+                    destroy(*it);
+            }
+            active_.swap(kept);
+            used_ = 0;
+            for (std::vector<slab*>::const_iterator it(active_.begin()); it != active_.end(); ++it)
+                used_ += (*it)->used;
+        }
+        
+        std::size_t used() const { return used_; }
+        
+        std::size_t reserved() const { return reserved_; }
+        
+        std::size_t slabs() const { return active_.size() + free_.size(); }
+        
+    private:
+        struct slab
+        {
+            std::size_t size;
+            std::size_t used;
+            std::size_t pins;
+            
+            char *data() { return reinterpret_cast<char*>(this) + align(sizeof(slab)); }
+        };
+        
+        class collector: private boost::noncopyable
+        {
+        public:
+            collector(const slab_arena::ptr& arena, const transfer::ptr& trans, const done_handler& handler)
+                : arena_(arena),
+                  transfer_(trans),
+                  on_done_(handler),
+                  slab_(NULL),
+                  data_(NULL),
+                  size_(0),
+                  capacity_(0)
+            {
+            }
+            
+            data_action::type data_read(const boost::asio::const_buffer& buffer)
+            {
+                const char *data = boost::asio::buffer_cast<const char*>(buffer);
+                std::size_t size = boost::asio::buffer_size(buffer);
+                
+                if (!data_)
+                {
+                    transfer::ptr trans(transfer_.lock());
+                    curl_off_t length = trans ? trans->info().content_length_download() : 0;
+                    std::size_t expected = length > 0 ? static_cast<std::size_t>(std::min<curl_off_t>(length, arena_->max_reserve_)) : 0;
+                    reserve(std::max(expected, size));
+                }
+                else if (size_ + size > capacity_)
+                {
+                    std::size_t grown = arena_->extend(slab_, data_ + capacity_, size_ + size - capacity_);
+                    if (grown)
+                        capacity_ += grown;
+                    else
+                        relocate(std::max(capacity_ * 2, size_ + size));
+                }
+                
+                std::memcpy(data_ + size_, data, size);
+                size_ += size;
+                return data_action::success;
+            }
+            
+            void upstream_done(CURLcode result)
+            {
+                transfer::ptr trans(transfer_.lock());
+                if (trans)
+                    trans->on_data_read.clear();
+                
+                if (slab_)
+                {
+                    arena_->trim(slab_, data_ + capacity_, capacity_ - size_);
+                    --slab_->pins;
+                    slab_ = NULL;
+                }
+                
+                done_handler handler;
+                handler.swap(on_done_);
+                if (handler)
+                    handler(result, view(data_, size_));
+            }
+            
+        private:
+            slab_arena::ptr arena_;
+            boost::weak_ptr<transfer> transfer_;
+            done_handler on_done_;
+            slab *slab_;
+            char *data_;
+            std::size_t size_;
+            std::size_t capacity_;
+            
+            void reserve(std::size_t capacity)
+            {
+                data_ = arena_->allocate(capacity, slab_);
+                ++slab_->pins;
+                capacity_ = align(capacity);
+            }
+            
+            void relocate(std::size_t capacity)
+            {
+                slab *old = slab_;
+                char *data = data_;
+                arena_->trim(old, data_ + capacity_, capacity_ - size_);
+                reserve(capacity);
+                std::memcpy(data_, data, size_);
+                --old->pins;
+            }
+        };
+        
+        struct collector_binding
+        {
+            boost::shared_ptr<collector> target;
+            
+            explicit collector_binding(const boost::shared_ptr<collector>& c)
+                : target(c)
+            {
+            }
+            
+            data_action::type operator()(const boost::asio::const_buffer& buffer) const
+            {
+                return target->data_read(buffer);
+            }
+            
+            void operator()(CURLcode result) const
+            {
+                target->upstream_done(result);
+            }
+        };
+        
+        const std::size_t slab_size_;
+        const std::size_t max_reserve_;
+        std::vector<slab*> active_;
+        std::vector<slab*> free_;
+        std::size_t used_;
+        std::size_t reserved_;
+        
+        slab_arena(std::size_t slab_size, std::size_t max_reserve)
+            : slab_size_(std::max<std::size_t>(slab_size, 4096)),
+              max_reserve_(max_reserve),
+              used_(0),
+              reserved_(0)
+        {
+        }
+        
+        static inline std::size_t align(std::size_t size)
+        {
+            return (size + 15) & ~static_cast<std::size_t>(15);
+        }
+        
+        slab *make(std::size_t size)
+        {
+            slab *s = static_cast<slab*>(::operator new(align(sizeof(slab)) + size));
+            s->size = size;
+            s->used = 0;
+            s->pins = 0;
+            reserved_ += size;
+            return s;
+        }
+        
+        void destroy(slab *s)
+        {
+            reserved_ -= s->size;
+            ::operator delete(s);
+        }
+        
+        char *allocate(std::size_t size, slab*& owner)
+        {
+            std::size_t bytes = align(size);
+            if (bytes > slab_size_ / 4)
+            {
+                owner = make(bytes);
+                active_.insert(active_.begin(), owner);
+            }
+            else
+            {
+                if (active_.empty() || active_.back()->size - active_.back()->used < bytes)
+                {
+                    if (free_.empty())
+                        active_.push_back(make(slab_size_));
+                    else
+                    {
+                        active_.push_back(free_.back());
+                        free_.pop_back();
+                    }
+                }
+                owner = active_.back();
+            }
+            
+            char *p = owner->data() + owner->used;
+            owner->used += bytes;
+            used_ += bytes;
+            return p;
+        }
+        
+        std::size_t extend(slab *s, const char *end, std::size_t size)
+        {
+            std::size_t bytes = align(size);
+            if (end != s->data() + s->used || s->size - s->used < bytes)
+                return 0;
+            
+            s->used += bytes;
+            used_ += bytes;
+            return bytes;
+        }
+        
+        void trim(slab *s, const char *end, std::size_t unused)
+        {
+            std::size_t bytes = unused & ~static_cast<std::size_t>(15);
+            if (end != s->data() + s->used || !bytes)
+                return;
+            
+            s->used -= bytes;
+            used_ -= bytes;
+        }
+    };
+    
+    class callback_offload: public boost::enable_shared_from_this<callback_offload>,
+                            private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<callback_offload> ptr;
+        typedef boost::shared_ptr< const std::vector<char> > chunk_ptr;
+        typedef boost::function<data_action::type(const chunk_ptr&)> chunk_handler;
+        typedef boost::function<void(const std::string&)> header_handler;
+        typedef boost::function<void(CURLcode)> done_handler;
+        
+        static inline ptr create(transfer::ptr trans, boost::asio::io_service& worker, std::size_t high_water = 64, std::size_t low_water = 16)
+        {
+            ptr offload(new callback_offload(trans, worker, high_water, low_water));
+            trans->on_data_read = boost::bind(&callback_offload::data_read, offload, _1);
+            trans->on_header = boost::bind(&callback_offload::header, offload, _1);
+            trans->add_done_hook(boost::bind(&callback_offload::upstream_done, offload, _1));
+            return offload;
+        }
+        
+        chunk_handler on_data;
+        header_handler on_header;
+        done_handler on_done;
+        
+        void resume()
+        {
+            strand_.post(boost::bind(&callback_offload::do_resume, shared_from_this()));
+        }
+        
+        std::size_t queued() const { return queue_.read_available(); }
+        
+    private:
+        enum
+        {
+            headroom = 16
+        };
+        
+        struct item
+        {
+            chunk_ptr chunk;
+            bool header;
+            
+            item()
+                : header(false)
+            {
+            }
+        };
+        
+        boost::weak_ptr<transfer> transfer_;
+        boost::asio::io_service& network_;
+        boost::asio::io_service::strand network_strand_;
+        boost::shared_ptr<boost::asio::io_service::work> network_work_;
+        boost::asio::io_service::strand strand_;
+        const std::size_t high_water_;
+        const std::size_t low_water_;
+        boost::lockfree::spsc_queue<item> queue_;
+        memory_budget::account::ptr account_;
+        boost::atomic<bool> scheduled_;
+        boost::atomic<bool> upstream_paused_;
+        boost::atomic<bool> done_;
+        CURLcode result_;
+        item held_;
+        bool holding_;
+        bool worker_paused_;
+        bool cancelled_;
+        bool done_delivered_;
+        
+        callback_offload(transfer::ptr trans, boost::asio::io_service& worker, std::size_t high_water, std::size_t low_water)
+            : transfer_(trans),
+              network_(trans->impl_->get_io_service()),
+              network_strand_(trans->impl_->get_strand()),
+              strand_(worker),
+              high_water_(std::max<std::size_t>(high_water, 1)),
+              low_water_(std::min(low_water, high_water_ - 1)),
+              queue_(high_water_ + headroom),
+              account_(trans->impl_->get_budget().open(trans)),
+              scheduled_(false),
+              upstream_paused_(false),
+              done_(false),
+              result_(CURLE_OK),
+              holding_(false),
+              worker_paused_(false),
+              cancelled_(false),
+              done_delivered_(false)
+        {
+        }
+        
+        data_action::type data_read(const boost::asio::const_buffer& buffer)
+        {
+            const char *data = boost::asio::buffer_cast<const char*>(buffer);
+            std::size_t size = boost::asio::buffer_size(buffer);
+            
+            if (!account_->admit())
+                return data_action::pause;
+            
+            item entry;
+            entry.chunk = account_->make_chunk(data, size);
+            if (!queue_.push(entry))
+            {
+                pause_upstream();
+                schedule();
+                return data_action::pause;
+            }
+            
+            if (queue_.write_available() <= headroom)
+            {
+                pause_upstream();
+                transfer::ptr trans(transfer_.lock());
+                if (trans)
+                    trans->pause(CURLPAUSE_RECV);
+            }
+            
+            schedule();
+            return data_action::success;
+        }
+        
+        header_action::type header(const std::string &line)
+        {
+            item entry;
+            entry.chunk.reset(new std::vector<char>(line.begin(), line.end()));
+            entry.header = true;
+            if (!queue_.push(entry))
+                return header_action::abort;
+            
+            schedule();
+            return header_action::success;
+        }
+        
+        void upstream_done(CURLcode result)
+        {
+            network_work_.reset();
+            result_ = result;
+            done_ = true;
+            schedule();
+        }
+        
+        void pause_upstream()
+        {
+            if (!network_work_)
+                network_work_.reset(new boost::asio::io_service::work(network_));
+            upstream_paused_ = true;
+        }
+        
+        void schedule()
+        {
+            if (!scheduled_.exchange(true))
+                strand_.post(boost::bind(&callback_offload::drain, shared_from_this()));
+        }
+        
+        void drain()
+        {
+            scheduled_ = false;
+            
+            if (holding_ && !worker_paused_)
+            {
+                holding_ = false;
+                if (!deliver(held_))
+                    return;
+            }
+            
+            item entry;
+            while (!worker_paused_ && queue_.pop(entry))
+            {
+                resume_upstream();
+                if (!deliver(entry))
+                    return;
+            }
+            
+            resume_upstream();
+            if (!worker_paused_ && done_ && !done_delivered_ && !queue_.read_available())
+            {
+                done_delivered_ = true;
+                if (on_done)
+                    on_done(result_);
+            }
+        }
+        
+        bool deliver(const item& entry)
+        {
+            if (cancelled_)
+                return true;
+            
+            if (entry.header)
+            {
+                if (on_header)
+                    on_header(std::string(entry.chunk->begin(), entry.chunk->end()));
+                return true;
+            }
+            
+            switch (on_data ? on_data(entry.chunk) : data_action::success)
+            {
+                case data_action::success:
+                    return true;
+                case data_action::pause:
+                    held_ = entry;
+                    holding_ = true;
+                    worker_paused_ = true;
+                    return false;
+                case data_action::abort:
+                default:
+                    cancelled_ = true;
+                    network_strand_.post(boost::bind(&callback_offload::cancel_upstream, shared_from_this()));
+                    return true;
+            }
+        }
+        
+        void do_resume()
+        {
+            if (!worker_paused_)
+                return;
+            
+            worker_paused_ = false;
+            drain();
+        }
+        
+        void resume_upstream()
+        {
+            if (upstream_paused_ && queue_.read_available() <= low_water_ && upstream_paused_.exchange(false))
+                network_strand_.post(boost::bind(&callback_offload::do_resume_upstream, shared_from_this()));
+        }
+        
+        void do_resume_upstream()
+        {
+            network_work_.reset();
+            transfer::ptr trans(transfer_.lock());
+            if (trans)
+                trans->resume(CURLPAUSE_RECV);
+        }
+        
+        void cancel_upstream()
+        {
+            transfer::ptr trans(transfer_.lock());
+            if (trans)
+                trans->stop();
+        }
+    };
+    
+    class line_splitter: public boost::enable_shared_from_this<line_splitter>,
+                         private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<line_splitter> ptr;
+        typedef boost::function<data_action::type(const boost::asio::const_buffer&)> record_handler;
+        
+        static inline ptr create(transfer::ptr trans, const record_handler& on_record, char delimiter = '\n', std::size_t max_record = 0)
+        {
+            ptr splitter(new line_splitter(on_record, delimiter, max_record));
+            trans->on_data_read = boost::bind(&line_splitter::feed, splitter, _1);
+            trans->add_done_hook(boost::bind(&line_splitter::upstream_done, splitter, _1));
+            return splitter;
+        }
+        
+        line_splitter(const record_handler& on_record, char delimiter = '\n', std::size_t max_record = 0)
+            : on_record_(on_record),
+              delimiter_(delimiter),
+              max_record_(max_record),
+              skip_(0)
+        {
+        }
+        
+        data_action::type feed(const boost::asio::const_buffer& buffer)
+        {
+            const char *data = boost::asio::buffer_cast<const char*>(buffer);
+            const char *end = data + boost::asio::buffer_size(buffer);
+            const char *p = data + std::min(skip_, boost::asio::buffer_size(buffer));
+            skip_ = 0;
+            
+            while (p < end)
+            {
+                const char *delim = find_delimiter(p, end, delimiter_);
+                if (!delim)
+                {
+                    if (max_record_ > 0 && partial_.size() + (end - p) > max_record_)
+                        return data_action::abort;
+                    partial_.insert(partial_.end(), p, end);
+                    break;
+                }
+                
+                data_action::type action;
+                if (partial_.empty())
+                    action = on_record_(boost::asio::const_buffer(p, delim - p));
+                else
+                {
+                    partial_.insert(partial_.end(), p, delim);
+                    action = on_record_(boost::asio::buffer(partial_));
+                    partial_.clear();
+                }
+                p = delim + 1;
+                
+                if (action == data_action::pause)
+                {
+                    skip_ = p - data;
+                    return data_action::pause;
+                }
+                else if (action != data_action::success)
+                    return action;
+            }
+            
+            return data_action::success;
+        }
+        
+        data_action::type finish()
+        {
+            if (partial_.empty())
+                return data_action::success;
+            
+            data_action::type action = on_record_(boost::asio::buffer(partial_));
+            partial_.clear();
+            return action;
+        }
+        
+        void reset()
+        {
+            partial_.clear();
+            skip_ = 0;
+        }
+        
+        static inline const char *find_delimiter(const char *p, const char *end, char delimiter)
+        {
+#if defined(__SSE2__) && defined(__GNUC__)
+            const __m128i needle = _mm_set1_epi8(delimiter);
+            for (; end - p >= 16; p += 16)
+            {
+                int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), needle));
+                if (mask)
+                    return p + __builtin_ctz(mask);
+            }
+#endif
+            return static_cast<const char*>(std::memchr(p, delimiter, end - p));
+        }
+        
+    private:
+        record_handler on_record_;
+        const char delimiter_;
+        const std::size_t max_record_;
+        std::size_t skip_;
+        std::vector<char> partial_;
+        
+        void upstream_done(CURLcode result)
+        {
+            if (result == CURLE_OK)
+                finish();
+            reset();
+        }
+    };
+    
+    class message_splitter: public boost::enable_shared_from_this<message_splitter>,
+                            private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<message_splitter> ptr;
+        typedef boost::function<data_action::type(const boost::asio::const_buffer&)> message_handler;
+        
+        struct prefix
+        {
+            typedef enum
+            {
+                varint,
+                fixed32,
+                grpc
+            } type;
+        };
+        
+        static inline ptr create(transfer::ptr trans, const message_handler& on_message, prefix::type prefix_type = prefix::varint, std::size_t max_message = 64 * 1024 * 1024)
+        {
+            ptr splitter(new message_splitter(on_message, prefix_type, max_message));
+            trans->on_data_read = boost::bind(&message_splitter::feed, splitter, _1);
+            trans->add_done_hook(boost::bind(&message_splitter::upstream_done, splitter, _1));
+            return splitter;
+        }
+        
+        message_splitter(const message_handler& on_message, prefix::type prefix_type = prefix::varint, std::size_t max_message = 64 * 1024 * 1024)
+            : on_message_(on_message),
+              prefix_(prefix_type),
+              max_message_(max_message),
+              skip_(0),
+              header_len_(0),
+              remaining_(0),
+              in_body_(false)
+        {
+        }
+        
+        data_action::type feed(const boost::asio::const_buffer& buffer)
+        {
+            const char *data = boost::asio::buffer_cast<const char*>(buffer);
+            const char *end = data + boost::asio::buffer_size(buffer);
+            const char *p = data + std::min(skip_, boost::asio::buffer_size(buffer));
+            skip_ = 0;
+            
+            while (p < end || (in_body_ && remaining_ == 0))
+            {
+                data_action::type action;
+                if (!in_body_)
+                {
+                    if (!parse_header(p, end))
+                        return data_action::abort;
+                    if (!in_body_)
+                        break;
+                    continue;
+                }
+                else if (arena_.empty() && static_cast<std::size_t>(end - p) >= remaining_)
+                {
+                    action = on_message_(boost::asio::const_buffer(p, remaining_));
+                    p += remaining_;
+                }
+                else
+                {
+                    std::size_t n = std::min(remaining_ - arena_.size(), static_cast<std::size_t>(end - p));
+                    arena_.insert(arena_.end(), p, p + n);
+                    p += n;
+                    if (arena_.size() < remaining_)
+                        break;
+                    
+                    action = on_message_(boost::asio::buffer(arena_));
+                    arena_.clear();
+                }
+                
+                in_body_ = false;
+                remaining_ = 0;
+                
+                if (action == data_action::pause)
+                {
+                    skip_ = p - data;
+                    return data_action::pause;
+                }
+                else if (action != data_action::success)
+                    return action;
+            }
+            
+            return data_action::success;
+        }
+        
+        bool pending() const
+        {
+            return in_body_ || header_len_ > 0;
+        }
+        
+        void reset()
+        {
+            arena_.clear();
+            skip_ = 0;
+            header_len_ = 0;
+            remaining_ = 0;
+            in_body_ = false;
+        }
+        
+    private:
+        enum { max_header = 10 };
+        
+        message_handler on_message_;
+        const prefix::type prefix_;
+        const std::size_t max_message_;
+        std::size_t skip_;
+        unsigned char header_[max_header];
+        std::size_t header_len_;
+        std::size_t remaining_;
+        bool in_body_;
+        std::vector<char> arena_;
+        
+        bool parse_header(const char *&p, const char *end)
+        {
+            boost::uint64_t length = 0;
+            
+            if (prefix_ == prefix::fixed32 || prefix_ == prefix::grpc)
+            {
+                const std::size_t size = prefix_ == prefix::grpc ? 5 : 4;
+                while (p < end && header_len_ < size)
+                    header_[header_len_++] = static_cast<unsigned char>(*p++);
+                if (header_len_ < size)
+                    return true;
+                
+                const unsigned char *len = header_ + size - 4;
+                if (prefix_ == prefix::grpc && header_[0] != 0)
+                    return false;
+                length = (boost::uint64_t(len[0]) << 24) | (boost::uint64_t(len[1]) << 16) | (boost::uint64_t(len[2]) << 8) | boost::uint64_t(len[3]);
+            }
+            else
+            {
+                bool complete = false;
+                while (p < end && !complete)
+                {
+                    if (header_len_ == max_header)
+                        return false;
+                    header_[header_len_] = static_cast<unsigned char>(*p++);
+                    complete = !(header_[header_len_++] & 0x80);
+                }
+                if (!complete)
+                    return true;
+                
+                for (std::size_t i = header_len_; i > 0; --i)
+                    length = (length << 7) | (header_[i - 1] & 0x7f);
+            }
+            
+            if (max_message_ > 0 && length > max_message_)
+                return false;
+            
+            header_len_ = 0;
+            remaining_ = static_cast<std::size_t>(length);
+            in_body_ = true;
+            return true;
+        }
+        
+        void upstream_done(CURLcode)
+        {
+            reset();
+        }
+    };
+    
+    class digest_verifier: public boost::enable_shared_from_this<digest_verifier>,
+                           private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<digest_verifier> ptr;
+        
+        struct algorithm
+        {
+            typedef enum
+            {
+                crc32c,
+                sha256,
+                md5,
+                xxh3
+            } type;
+        };
+        
+        static inline ptr create(transfer::ptr trans, algorithm::type alg, const std::string &expected_hex = std::string())
+        {
+            ptr verifier(new digest_verifier(trans, alg));
+            if (!verifier->init(expected_hex))
+                return ptr();
+            
+            verifier->downstream_ = trans->on_data_read;
+            verifier->next_header_ = trans->on_header;
+            trans->on_data_read = boost::bind(&digest_verifier::feed, verifier, _1);
+            trans->on_header = boost::bind(&digest_verifier::header, verifier, _1);
+            trans->add_result_filter(boost::bind(&digest_verifier::check, verifier, _1));
+            return verifier;
+        }
+        
+        ~digest_verifier()
+        {
+#ifdef CURL_ASIO_ENABLE_OPENSSL
+            if (md_)
+                ::EVP_MD_CTX_free(md_);
+#endif
+#ifdef CURL_ASIO_ENABLE_XXHASH
+            if (xxh_)
+                ::XXH3_freeState(xxh_);
+#endif
+        }
+        
+        bool verified() const { return verified_; }
+        
+        bool mismatch() const { return mismatch_; }
+        
+        curl_off_t bytes() const { return received_; }
+        
+        std::string digest() const
+        {
+            static const char hex[] = "0123456789abcdef";
+            std::string ret;
+            for (std::string::const_iterator it(digest_.begin()); it != digest_.end(); ++it)
+            {
+                ret += hex[(static_cast<unsigned char>(*it) >> 4) & 0xf];
+                ret += hex[static_cast<unsigned char>(*it) & 0xf];
+            }
+            return ret;
+        }
+        
+    private:
+        struct crc32c_table
+        {
+            boost::uint32_t entries[256];
+            
+            crc32c_table()
+            {
+                for (boost::uint32_t i = 0; i < 256; ++i)
+                {
+                    boost::uint32_t crc = i;
+                    for (int bit = 0; bit < 8; ++bit)
+                        crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+                    entries[i] = crc;
+                }
+            }
+        };
+        
+        boost::weak_ptr<transfer> transfer_;
+        const algorithm::type algorithm_;
+        transfer::data_read_handler downstream_;
+        transfer::header_handler next_header_;
+        std::string expected_;
+        std::string header_expected_;
+        std::string digest_;
+        bool encoded_;
+        curl_off_t content_length_;
+        curl_off_t received_;
+        std::size_t skip_;
+        bool finished_;
+        bool verified_;
+        bool mismatch_;
+        boost::uint32_t crc_;
+#ifdef CURL_ASIO_ENABLE_OPENSSL
+        EVP_MD_CTX *md_;
+#endif
+#ifdef CURL_ASIO_ENABLE_XXHASH
+        XXH3_state_t *xxh_;
+#endif
+        
+        digest_verifier(transfer::ptr trans, algorithm::type alg)
+            : transfer_(trans),
+              algorithm_(alg),
+              encoded_(false),
+              content_length_(-1),
+              received_(0),
+              skip_(0),
+              finished_(false),
+              verified_(false),
+              mismatch_(false),
+              crc_(0)
+#ifdef CURL_ASIO_ENABLE_OPENSSL
+              , md_(NULL)
+#endif
+#ifdef CURL_ASIO_ENABLE_XXHASH
+              , xxh_(NULL)
+#endif
+        {
+        }
+        
+        bool init(const std::string &expected_hex)
+        {
+            if (!decode_hex(expected_hex, expected_))
+                return false;
+            
+            switch (algorithm_)
+            {
+                case algorithm::crc32c:
+                    break;
+#ifdef CURL_ASIO_ENABLE_OPENSSL
+                case algorithm::sha256:
+                case algorithm::md5:
+                    md_ = ::EVP_MD_CTX_new();
+                    if (!md_)
+                        return false;
+                    break;
+#endif
+#ifdef CURL_ASIO_ENABLE_XXHASH
+                case algorithm::xxh3:
+                    xxh_ = ::XXH3_createState();
+                    if (!xxh_)
+                        return false;
+                    break;
+#endif
+                default:
+                    return false;
+            }
+            
+            return restart();
+        }
+        
+        bool restart()
+        {
+            header_expected_.clear();
+            digest_.clear();
+            encoded_ = false;
+            content_length_ = -1;
+            received_ = 0;
+            skip_ = 0;
+            finished_ = false;
+            verified_ = false;
+            mismatch_ = false;
+            crc_ = 0xffffffff;
+            
+            switch (algorithm_)
+            {
+#ifdef CURL_ASIO_ENABLE_OPENSSL
+                case algorithm::sha256:
+                    return ::EVP_DigestInit_ex(md_, ::EVP_sha256(), NULL) == 1;
+                case algorithm::md5:
+                    return ::EVP_DigestInit_ex(md_, ::EVP_md5(), NULL) == 1;
+#endif
+#ifdef CURL_ASIO_ENABLE_XXHASH
+                case algorithm::xxh3:
+                    return ::XXH3_64bits_reset(xxh_) == XXH_OK;
+#endif
+                default:
+                    return true;
+            }
+        }
+        
+        void update(const char *data, std::size_t size)
+        {
+            switch (algorithm_)
+            {
+                case algorithm::crc32c:
+                    crc_ = crc32c_update(crc_, data, size);
+                    break;
+#ifdef CURL_ASIO_ENABLE_OPENSSL
+                case algorithm::sha256:
+                case algorithm::md5:
+                    ::EVP_DigestUpdate(md_, data, size);
+                    break;
+#endif
+#ifdef CURL_ASIO_ENABLE_XXHASH
+                case algorithm::xxh3:
+                    ::XXH3_64bits_update(xxh_, data, size);
+                    break;
+#endif
+                default:
+                    break;
+            }
+        }
+        
+        void finalize()
+        {
+            if (finished_)
+                return;
+            
+            finished_ = true;
+            switch (algorithm_)
+            {
+                case algorithm::crc32c:
+                    append_big_endian(~crc_, 4);
+                    break;
+#ifdef CURL_ASIO_ENABLE_OPENSSL
+                case algorithm::sha256:
+                case algorithm::md5:
+                {
+                    unsigned char md[EVP_MAX_MD_SIZE];
+                    unsigned int md_len = 0;
+                    if (::EVP_DigestFinal_ex(md_, md, &md_len) == 1)
+                        digest_.assign(reinterpret_cast<const char*>(md), md_len);
+                    break;
+                }
+#endif
+#ifdef CURL_ASIO_ENABLE_XXHASH
+                case algorithm::xxh3:
+                    append_big_endian(::XXH3_64bits_digest(xxh_), 8);
+                    break;
+#endif
+                default:
+                    break;
+            }
+        }
+        
+        void append_big_endian(boost::uint64_t value, int bytes)
+        {
+            for (int i = bytes - 1; i >= 0; --i)
+                digest_ += static_cast<char>((value >> (i * 8)) & 0xff);
+        }
+        
+        bool describes_body() const
+        {
+            if (!encoded_)
+                return true;
+            
+            transfer::ptr trans(transfer_.lock());
+            return trans && trans->opt.raw_passthrough;
+        }
+        
+        bool compare()
+        {
+            const std::string &expected = !expected_.empty() ? expected_ : header_expected_;
+            if (expected.empty() || (expected_.empty() && !describes_body()))
+                return true;
+            
+            verified_ = digest_ == expected;
+            mismatch_ = !verified_;
+            return verified_;
+        }
+        
+        data_action::type feed(const boost::asio::const_buffer &buffer)
+        {
+            const char *data = boost::asio::buffer_cast<const char*>(buffer);
+            std::size_t size = boost::asio::buffer_size(buffer);
+            std::size_t hashed = std::min(skip_, size);
+            skip_ -= hashed;
+            
+            if (hashed < size)
+            {
+                if (finished_)
+                    return data_action::abort;
+                
+                update(data + hashed, size - hashed);
+                received_ += size - hashed;
+                
+                if (content_length_ >= 0 && received_ >= content_length_ && describes_body())
+                {
+                    finalize();
+                    if (!compare())
+                        return data_action::abort;
+                }
+            }
+            
+            if (!downstream_)
+                return data_action::success;
+            
+            data_action::type action = downstream_(buffer);
+            if (action == data_action::pause)
+                skip_ += size;
+            return action;
+        }
+        
+        header_action::type header(const std::string &line)
+        {
+            std::string value;
+            if (line.compare(0, 5, "HTTP/") == 0)
+                restart();
+            else if (header_value(line, "content-length", value))
+                content_length_ = std::strtoll(value.c_str(), NULL, 10);
+            else if (header_value(line, "content-encoding", value))
+                encoded_ = !value.empty() && value != "identity";
+            else if (header_value(line, "digest", value))
+                parse_digest(value);
+            else if (header_value(line, "content-md5", value) && algorithm_ == algorithm::md5)
+                decode_base64(value, header_expected_);
+            
+            if (next_header_)
+                return next_header_(line);
+            return header_action::success;
+        }
+        
+        void parse_digest(const std::string &value)
+        {
+            const char *name = algorithm_ == algorithm::sha256 ? "sha-256" : (algorithm_ == algorithm::md5 ? "md5" : (algorithm_ == algorithm::crc32c ? "crc32c" : NULL));
+            if (!name)
+                return;
+            
+            std::string::size_type begin = 0;
+            while (begin < value.size())
+            {
+                std::string::size_type end = value.find(',', begin);
+                if (end == std::string::npos)
+                    end = value.size();
+                
+                std::string item(value, begin, end - begin);
+                std::string::size_type first = item.find_first_not_of(" \t");
+                std::string::size_type eq = item.find('=');
+                if (first != std::string::npos && eq != std::string::npos && eq > first && lower_equals(item.substr(first, eq - first), name))
+                {
+                    std::string encoded(item, eq + 1);
+                    encoded.erase(encoded.find_last_not_of(" \t") + 1);
+                    if (algorithm_ == algorithm::crc32c)
+                        decode_hex(encoded, header_expected_);
+                    else
+                        decode_base64(encoded, header_expected_);
+                    return;
+                }
+                begin = end + 1;
+            }
+        }
+        
+        CURLcode check(CURLcode result)
+        {
+            transfer::ptr trans(transfer_.lock());
+            if (trans)
+            {
+                trans->on_data_read = downstream_;
+                trans->on_header = next_header_;
+            }
+            
+            if (result != CURLE_OK)
+                return result;
+            
+            finalize();
+            return compare() ? result : CURLE_WRITE_ERROR;
+        }
+        
+        static inline bool lower_equals(const std::string &str, const char *name)
+        {
+            if (str.size() != std::strlen(name))
+                return false;
+            
+            for (std::string::size_type i = 0; i < str.size(); ++i)
+            {
+                if (std::tolower(static_cast<unsigned char>(str[i])) != name[i])
+                    return false;
+            }
+            return true;
+        }
+        
+        static inline bool header_value(const std::string &line, const char *name, std::string &value)
+        {
+            std::string::size_type colon = line.find(':');
+            if (colon == std::string::npos || !lower_equals(line.substr(0, colon), name))
+                return false;
+            
+            std::string::size_type begin = line.find_first_not_of(" \t", colon + 1);
+            std::string::size_type end = line.find_last_not_of(" \t\r\n");
+            value = begin != std::string::npos && end != std::string::npos && end >= begin ? line.substr(begin, end - begin + 1) : std::string();
+            return true;
+        }
+        
+        static inline bool decode_hex(const std::string &hex, std::string &out)
+        {
+            out.clear();
+            if (hex.size() % 2)
+                return false;
+            
+            for (std::string::size_type i = 0; i < hex.size(); i += 2)
+            {
+                int hi = hex_digit(hex[i]);
+                int lo = hex_digit(hex[i + 1]);
+                if (hi < 0 || lo < 0)
+                {
+                    out.clear();
+                    return false;
+                }
+                out += static_cast<char>((hi << 4) | lo);
+            }
+            return true;
+        }
+        
+        static inline int hex_digit(char c)
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            return -1;
+        }
+        
+        static inline bool decode_base64(const std::string &text, std::string &out)
+        {
+            out.clear();
+            boost::uint32_t bits = 0;
+            int count = 0;
+            for (std::string::const_iterator it(text.begin()); it != text.end() && *it != '='; ++it)
+            {
+                const char *pos = std::strchr(base64_alphabet(), *it);
+                if (!*it || !pos)
+                {
+                    out.clear();
+                    return false;
+                }
+                
+                bits = (bits << 6) | static_cast<boost::uint32_t>(pos - base64_alphabet());
+                count += 6;
+                if (count >= 8)
+                {
+                    count -= 8;
+                    out += static_cast<char>((bits >> count) & 0xff);
+                }
+            }
+            return true;
+        }
+        
+        static inline const char *base64_alphabet()
+        {
+            return "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        }
+        
+        static inline boost::uint32_t crc32c_update(boost::uint32_t crc, const char *p, std::size_t size)
+        {
+#if defined(__SSE4_2__) && defined(__GNUC__)
+#if defined(__x86_64__)
+            boost::uint64_t crc64 = crc;
+            for (; size >= 8; p += 8, size -= 8)
+            {
+                boost::uint64_t word;
+                std::memcpy(&word, p, sizeof(word));
+                crc64 = _mm_crc32_u64(crc64, word);
+            }
+            crc = static_cast<boost::uint32_t>(crc64);
+#endif
+            for (; size > 0; ++p, --size)
+                crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*p));
+#else
+            static const crc32c_table table;
+            for (; size > 0; ++p, --size)
+                crc = table.entries[(crc ^ static_cast<unsigned char>(*p)) & 0xff] ^ (crc >> 8);
+#endif
+            return crc;
+        }
+    };
+    
+    class event_source: public boost::enable_shared_from_this<event_source>,
+                        private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<event_source> ptr;
+        
+        struct event
+        {
+            std::string type;
+            std::string data;
+            std::string id;
+        };
+        
+        typedef boost::function<void(const event&)> event_handler;
+        typedef boost::function<void(CURLcode)> done_handler;
+        
+        static inline ptr create(transfer::ptr trans)
+        {
+            if (trans->shares_options())
+                return ptr();
+            
+            return ptr(new event_source(trans));
+        }
+        
+        event_handler on_event;
+        done_handler on_disconnect;
+        done_handler on_done;
+        
+        bool start(const std::string &uri)
+        {
+            if (trans_->running())
+                return false;
+            
+            uri_ = uri;
+            http_header_ = trans_->opt.http_header;
+            stopped_ = false;
+            return connect();
+        }
+        
+        void stop()
+        {
+            if (stopped_)
+                return;
+            
+            stopped_ = true;
+            timer_.cancel();
+            if (!trans_->stop())
+                finish(CURLE_ABORTED_BY_CALLBACK);
+        }
+        
+        const std::string& last_event_id() const { return last_event_id_; }
+        
+        long retry_ms() const { return retry_ms_; }
+        
+        transfer::ptr get_transfer() const { return trans_; }
+        
+    private:
+        transfer::ptr trans_;
+        line_splitter splitter_;
+        boost::asio::deadline_timer timer_;
+        boost::asio::io_service::strand strand_;
+        std::string uri_;
+        std::list<std::string> http_header_;
+        std::string last_event_id_;
+        event event_;
+        long retry_ms_;
+        bool stopped_;
+        bool first_line_;
+        
+        event_source(transfer::ptr trans)
+            : trans_(trans),
+              splitter_(boost::bind(&event_source::line, this, _1)),
+              timer_(trans->impl_->get_io_service()),
+              strand_(trans->impl_->get_strand()),
+              retry_ms_(3000),
+              stopped_(true),
+              first_line_(true)
+        {
+        }
+        
+        bool connect()
+        {
+            trans_->opt.http_header = http_header_;
+            trans_->opt.http_header.push_back("Accept: text/event-stream");
+            trans_->opt.http_header.push_back("Cache-Control: no-cache");
+            if (!last_event_id_.empty())
+                trans_->opt.http_header.push_back("Last-Event-ID: " + last_event_id_);
+            
+            splitter_.reset();
+            event_.type.clear();
+            event_.data.clear();
+            first_line_ = true;
+            
+            trans_->on_data_read = boost::bind(&event_source::data_read, shared_from_this(), _1);
+            if (!trans_->start(uri_))
+            {
+                trans_->on_data_read.clear();
+                return false;
+            }
+            
+            trans_->add_done_hook(boost::bind(&event_source::transfer_done, shared_from_this(), _1));
+            return true;
+        }
+        
+        data_action::type data_read(const boost::asio::const_buffer& buffer)
+        {
+            return splitter_.feed(buffer);
+        }
+        
+        data_action::type line(const boost::asio::const_buffer& buffer)
+        {
+            const char *p = boost::asio::buffer_cast<const char*>(buffer);
+            const char *end = p + boost::asio::buffer_size(buffer);
+            
+            if (first_line_)
+            {
+                first_line_ = false;
+                if (end - p >= 3 && std::memcmp(p, "\xEF\xBB\xBF", 3) == 0)
+                    p += 3;
+            }
+            
+            if (p < end && end[-1] == '\r')
+                --end;
+            
+            if (p == end)
+            {
+                dispatch();
+                return data_action::success;
+            }
+            
+            if (*p == ':')
+                return data_action::success;
+            
+            const char *colon = static_cast<const char*>(std::memchr(p, ':', end - p));
+            const char *value = colon ? colon + 1 : end;
+            if (value < end && *value == ' ')
+                ++value;
+            std::size_t name_len = (colon ? colon : end) - p;
+            
+            if (field(p, name_len, "data"))
+            {
+                event_.data.append(value, end);
+                event_.data.push_back('\n');
+            }
+            else if (field(p, name_len, "event"))
+                event_.type.assign(value, end);
+            else if (field(p, name_len, "id"))
+            {
+                if (!std::memchr(value, '\0', end - value))
+                    event_.id.assign(value, end);
+            }
+            else if (field(p, name_len, "retry"))
+            {
+                long retry = 0;
+                const char *q = value;
+                for (; q < end && *q >= '0' && *q <= '9'; ++q)
+                    retry = retry * 10 + (*q - '0');
+                if (q == end && q > value)
+                    retry_ms_ = retry;
+            }
+            
+            return data_action::success;
+        }
+        
+        static inline bool field(const char *name, std::size_t len, const char *expected)
+        {
+            return std::strlen(expected) == len && std::memcmp(name, expected, len) == 0;
+        }
+        
+        void dispatch()
+        {
+            last_event_id_ = event_.id;
+            if (!event_.data.empty())
+            {
+                event_.data.erase(event_.data.size() - 1);
+                if (event_.type.empty())
+                    event_.type = "message";
+                if (on_event)
+                    on_event(event_);
+            }
+            event_.type.clear();
+            event_.data.clear();
+        }
+        
+        void transfer_done(CURLcode result)
+        {
+            if (stopped_)
+            {
+                finish(result);
+                return;
+            }
+            
+            long response_code = trans_->info().response_code();
+            if (on_disconnect)
+                on_disconnect(result);
+            
+            if (response_code != 0 && response_code != 200)
+            {
+                stopped_ = true;
+                finish(result);
+                return;
+            }
+            
+            timer_.expires_from_now(boost::posix_time::milliseconds(retry_ms_));
+            timer_.async_wait(strand_.wrap(boost::bind(&event_source::reconnect, shared_from_this(), boost::asio::placeholders::error)));
+        }
+        
+        void reconnect(const boost::system::error_code& err)
+        {
+            if (err || stopped_)
+                return;
+            
+            if (!connect())
+            {
+                stopped_ = true;
+                finish(CURLE_FAILED_INIT);
+            }
+        }
+        
+        void finish(CURLcode result)
+        {
+            trans_->on_data_read.clear();
+            if (on_done)
+                on_done(result);
+        }
+    };
+    
+    class grpc_call: public boost::enable_shared_from_this<grpc_call>,
+                     private boost::noncopyable
+    {
+    public:
+        typedef boost::shared_ptr<grpc_call> ptr;
+        typedef message_splitter::message_handler message_handler;
+        typedef boost::function<void(const boost::system::error_code&)> write_handler;
+        typedef boost::function<void(int, const std::string&, CURLcode)> done_handler;
+        
+        enum
+        {
+            status_ok = 0,
+            status_cancelled = 1,
+            status_unknown = 2,
+            status_unavailable = 14
+        };
+        
+        static inline ptr create(transfer::ptr trans)
+        {
+            if (trans->shares_options())
+                return ptr();
+            
+            return ptr(new grpc_call(trans));
+        }
+        
+        message_handler on_message;
+        done_handler on_done;
+        
+        bool start(const std::string &uri)
+        {
+            if (trans_->running())
+                return false;
+            
+            std::list<std::string> http_header(trans_->opt.http_header);
+            trans_->opt.http_header.push_back("Content-Type: application/grpc");
+            trans_->opt.http_header.push_back("TE: trailers");
+            trans_->opt.post = true;
+            trans_->opt.upload_size = -1;
+            if (trans_->opt.http_version == CURL_HTTP_VERSION_NONE)
+                trans_->opt.http_version = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+            
+            splitter_.reset();
+            writes_.clear();
+            writes_done_ = false;
+            status_ = -1;
+            status_message_.clear();
+            
+            trans_->on_data_read = boost::bind(&grpc_call::data_read, shared_from_this(), _1);
+            trans_->on_data_write = boost::bind(&grpc_call::read, shared_from_this(), _1);
+            trans_->on_header = boost::bind(&grpc_call::header, shared_from_this(), _1);
+            
+            bool started = trans_->start(uri);
+            trans_->opt.http_header.swap(http_header);
+            if (started)
+                trans_->add_done_hook(boost::bind(&grpc_call::transfer_done, shared_from_this(), _1));
+            else
+                unbind();
+            return started;
+        }
+        
+        void async_write(const boost::asio::const_buffer& message, const write_handler& handler)
+        {
+            if (!trans_->running() || writes_done_)
+            {
+                strand_.post(boost::bind(handler, boost::asio::error::broken_pipe));
+                return;
+            }
+            
+            std::size_t size = boost::asio::buffer_size(message);
+            writes_.push_back(pending_write());
+            pending_write& w(writes_.back());
+            w.header[0] = 0;
+            w.header[1] = static_cast<unsigned char>(size >> 24);
+            w.header[2] = static_cast<unsigned char>(size >> 16);
+            w.header[3] = static_cast<unsigned char>(size >> 8);
+            w.header[4] = static_cast<unsigned char>(size);
+            w.header_sent = 0;
+            w.payload = message;
+            w.handler = handler;
+            trans_->resume(CURLPAUSE_SEND);
+        }
+        
+        void writes_done()
+        {
+            writes_done_ = true;
+            trans_->resume(CURLPAUSE_SEND);
+        }
+        
+        void resume()
+        {
+            trans_->resume(CURLPAUSE_RECV);
+        }
+        
+        void cancel()
+        {
+            trans_->stop();
+        }
+        
+        int status() const { return status_; }
+        
+        const std::string& status_message() const { return status_message_; }
+        
+        transfer::ptr get_transfer() const { return trans_; }
+        
+    private:
+        struct pending_write
+        {
+            unsigned char header[5];
+            std::size_t header_sent;
+            boost::asio::const_buffer payload;
+            write_handler handler;
+        };
+        
+        transfer::ptr trans_;
+        boost::asio::io_service::strand strand_;
+        message_splitter splitter_;
+        std::list<pending_write> writes_;
+        bool writes_done_;
+        int status_;
+        std::string status_message_;
+        
+        grpc_call(transfer::ptr trans)
+            : trans_(trans),
+              strand_(trans->impl_->get_strand()),
+              splitter_(boost::bind(&grpc_call::message, this, _1), message_splitter::prefix::grpc),
+              writes_done_(false),
+              status_(-1)
+        {
+        }
+        
+        data_action::type message(const boost::asio::const_buffer& buffer)
+        {
+            return on_message ? on_message(buffer) : data_action::success;
+        }
+        
+        data_action::type data_read(const boost::asio::const_buffer& buffer)
+        {
+            return splitter_.feed(buffer);
+        }
+        
+        void unbind()
+        {
+            trans_->on_data_read.clear();
+            trans_->on_data_write.clear();
+            trans_->on_header.clear();
+        }
+        
+        data_action::type read(boost::asio::mutable_buffer& buf)
+        {
+            std::size_t size = boost::asio::buffer_size(buf);
+            while (!writes_.empty() && boost::asio::buffer_size(buf) > 0)
+            {
+                pending_write& w(writes_.front());
+                std::size_t n;
+                if (w.header_sent < sizeof(w.header))
+                {
+                    n = boost::asio::buffer_copy(buf, boost::asio::buffer(w.header + w.header_sent, sizeof(w.header) - w.header_sent));
+                    w.header_sent += n;
+                }
+                else
+                {
+                    n = boost::asio::buffer_copy(buf, w.payload);
+                    w.payload = w.payload + n;
+                }
+                buf = buf + n;
+                
+                if (w.header_sent == sizeof(w.header) && boost::asio::buffer_size(w.payload) == 0)
+                {
+                    strand_.post(boost::bind(w.handler, boost::system::error_code()));
+                    writes_.pop_front();
+                }
+            }
+            
+            if (boost::asio::buffer_size(buf) < size || (writes_.empty() && writes_done_))
+                return data_action::success;
+            return data_action::pause;
+        }
+        
+        header_action::type header(const std::string &line)
+        {
+            std::string::size_type colon = line.find(':');
+            if (colon == std::string::npos)
+                return header_action::success;
+            
+            std::string::size_type begin = line.find_first_not_of(" \t", colon + 1);
+            std::string::size_type end = line.find_last_not_of(" \t\r\n");
+            std::string value(begin != std::string::npos && end != std::string::npos && end >= begin ? line.substr(begin, end - begin + 1) : std::string());
+            
+            if (field(line, colon, "grpc-status"))
+                status_ = std::atoi(value.c_str());
+            else if (field(line, colon, "grpc-message"))
+                status_message_ = value;
+            
+            return header_action::success;
+        }
+        
+        static inline bool field(const std::string &line, std::string::size_type len, const char *name)
+        {
+            if (std::strlen(name) != len)
+                return false;
+            
+            for (std::string::size_type i = 0; i < len; ++i)
+            {
+                if (std::tolower(static_cast<unsigned char>(line[i])) != name[i])
+                    return false;
+            }
+            return true;
+        }
+        
+        void transfer_done(CURLcode result)
+        {
+            unbind();
+            splitter_.reset();
+            for (std::list<pending_write>::const_iterator it(writes_.begin()); it != writes_.end(); ++it)
+                strand_.post(boost::bind(it->handler, boost::asio::error::operation_aborted));
+            writes_.clear();
+            
+            int status = status_;
+            if (status < 0)
+            {
+                if (result == CURLE_OK)
+                    status = status_unknown;
+                else if (result == CURLE_ABORTED_BY_CALLBACK)
+                    status = status_cancelled;
+                else
+                    status = status_unavailable;
+            }
+            
+            if (on_done)
+                on_done(status, status_message_, result);
+        }
+    };
+    
+    class connection: public boost::enable_shared_from_this<connection>,
+                      private boost::noncopyable
+    {
+    public:
+        typedef boost::function<void(CURLcode)> connect_handler;
+        
+        virtual ~connection()
+        {
+            if (sock_)
+                sock_->cancel();
+            trans_->stop();
+        }
+        
+        bool async_connect(const std::string &uri, const connect_handler& handler)
+        {
+            if (open_ || trans_->running() || trans_->shares_options())
+                return false;
+            
+            trans_->opt.connect_only = mode_;
+            if (!trans_->start(uri))
+                return false;
+            
+            trans_->add_done_hook(boost::bind(&connection::connect_done, shared_from_this(), _1, handler));
+            return true;
+        }
+        
+        void close()
+        {
+            open_ = false;
+            if (sock_)
+            {
+                sock_->cancel();
+                sock_.reset();
+            }
+            trans_->stop();
+        }
+        
+        bool is_open() const { return open_; }
+        
+        transfer::ptr get_transfer() const { return trans_; }
+        
+        boost::asio::io_service& get_io_service() { return io_; }
+        
+    protected:
+        typedef boost::function<void(const boost::system::error_code&)> wait_handler;
+        
+        transfer::ptr trans_;
+        boost::asio::io_service& io_;
+        boost::asio::io_service::strand strand_;
+        const long mode_;
+        bool open_;
+        boost::shared_ptr<socketinfo> sock_;
+        
+        connection(transfer::ptr trans, long mode)
+            : trans_(trans),
+              io_(trans->impl_->get_io_service()),
+              strand_(trans->impl_->get_strand()),
+              mode_(mode),
+              open_(false)
+        {
+        }
+        
+        CURL *handle() const { return trans_->handle_; }
+        
+        void async_wait(int action, const wait_handler& handler)
+        {
+            if (!open_ || !sock_)
+                strand_.post(boost::bind(handler, boost::asio::error::not_connected));
+            else if (action == CURL_POLL_IN)
+                sock_->async_wait_read(strand_.wrap(boost::bind(handler, boost::asio::placeholders::error)));
+            else
+                sock_->async_wait_write(strand_.wrap(boost::bind(handler, boost::asio::placeholders::error)));
+        }
+        
+    private:
+        void connect_done(CURLcode result, connect_handler handler)
+        {
+            if (result == CURLE_OK)
             {
-                running_ = true;
-                return true;
+                curl_socket_t s = CURL_SOCKET_BAD;
+                if (::curl_easy_getinfo(trans_->handle_, CURLINFO_ACTIVESOCKET, &s) == CURLE_OK && s != CURL_SOCKET_BAD)
+                    sock_ = socketinfo::create(io_, s);
+                
+                if (sock_)
+                    open_ = true;
+                else
+                {
+                    result = CURLE_COULDNT_CONNECT;
+                    strand_.post(boost::bind(&connection::close, shared_from_this()));
+                }
             }
             
-            return false;
+            if (handler)
+                strand_.post(boost::bind(handler, result));
         }
+    };
+    
+    class connect_stream: public connection
+    {
+    public:
+        typedef boost::shared_ptr<connect_stream> ptr;
+        typedef boost::function<void(const boost::system::error_code&, std::size_t)> io_handler;
         
-        bool stop()
+        static inline ptr create(transfer::ptr trans)
         {
-            if (!running_ || !impl_)
-                return false;
-            
-            if (callback_recursions_ > 0)
-            {
-                running_ = false;
-                return true;
-            }
-            
-            if (impl_->remove_transfer(shared_from_this()))
-            {
-                running_ = false;
-                return true;
-            }
+            if (trans->shares_options())
+                return ptr();
             
-            return false;
+            return ptr(new connect_stream(trans));
         }
         
-        const transferinfo& info() const { return info_; }
-        
-        bool running() const { return running_; }
+#if BOOST_VERSION >= 106600
+        typedef boost::asio::io_service::executor_type executor_type;
         
-    private:
-        friend class curl_asio;
-        friend class socketinfo;
-        friend class implementation;
+        executor_type get_executor() { return io_.get_executor(); }
+#endif
         
-        boost::shared_ptr<implementation> impl_;
-        unsigned int callback_recursions_;
-        CURL* handle_;
-        curl_slist *httpheader_;
-        transferinfo info_;
-        bool running_;
-        std::string url_;
-        boost::shared_ptr<transfer> lock_;
+        template <typename MutableBufferSequence, typename ReadHandler>
+        void async_read_some(const MutableBufferSequence& buffers, ReadHandler handler)
+        {
+            read(first_buffer<boost::asio::mutable_buffer>(buffers), io_handler(handler), boost::system::error_code());
+        }
         
-        static inline boost::shared_ptr<transfer> from_easy(CURL *easy)
+        template <typename ConstBufferSequence, typename WriteHandler>
+        void async_write_some(const ConstBufferSequence& buffers, WriteHandler handler)
         {
-            void *trans;
-            CURLcode rc = ::curl_easy_getinfo(easy, CURLINFO_PRIVATE, &trans);
-            if (rc == CURLE_OK && trans)
-                return static_cast<transfer*>(trans)->shared_from_this();
-            return boost::shared_ptr<transfer>();
+            write(first_buffer<boost::asio::const_buffer>(buffers), io_handler(handler), boost::system::error_code());
         }
         
-        static inline boost::shared_ptr<transfer> from_ptr(void *ptr)
+    private:
+        connect_stream(transfer::ptr trans)
+            : connection(trans, 1l)
         {
-            return static_cast<transfer*>(ptr)->shared_from_this();
         }
         
-        transfer(boost::shared_ptr<implementation> impl)
-            : url(url_),
-              impl_(impl),
-              callback_recursions_(0),
-              handle_(NULL),
-              httpheader_(NULL),
-              info_(handle_),
-              running_(false)
+        ptr self()
         {
-            CURL_ASIO_LOGSCOPE("transfer::transfer", this);
+            return boost::static_pointer_cast<connect_stream>(shared_from_this());
         }
         
-        bool setup(const std::string &uri)
+        template <typename Buffer, typename BufferSequence>
+        static inline Buffer first_buffer(const BufferSequence& buffers)
         {
-            ::curl_easy_setopt(handle_, CURLOPT_URL, uri.c_str());
-            
-            ::curl_easy_setopt(handle_, CURLOPT_PROTOCOLS, opt.protocols);
-            ::curl_easy_setopt(handle_, CURLOPT_MAXREDIRS, opt.max_redirs);
-            ::curl_easy_setopt(handle_, CURLOPT_REDIR_PROTOCOLS, opt.redir_protocols);
-            ::curl_easy_setopt(handle_, CURLOPT_FAILONERROR, opt.fail_on_error ? 1l : 0l);
-            ::curl_easy_setopt(handle_, CURLOPT_FOLLOWLOCATION, opt.follow_location ? 1l : 0l);
-            ::curl_easy_setopt(handle_, CURLOPT_AUTOREFERER, opt.auto_referer ? 1l : 0l);
-            ::curl_easy_setopt(handle_, CURLOPT_HTTPPROXYTUNNEL, opt.http_proxy_tunnel ? 1l : 0l);
-            if (!opt.proxy.empty())
-                ::curl_easy_setopt(handle_, CURLOPT_PROXY, opt.proxy.c_str());
-            if (!opt.no_proxy.empty())
-                ::curl_easy_setopt(handle_, CURLOPT_NOPROXY, opt.no_proxy.c_str());
-            if (!opt.proxy_username.empty() || !opt.proxy_password.empty())
+            for (typename BufferSequence::const_iterator it(buffers.begin()); it != buffers.end(); ++it)
             {
-                ::curl_easy_setopt(handle_, CURLOPT_PROXYUSERNAME, opt.proxy_username.c_str());
-                ::curl_easy_setopt(handle_, CURLOPT_PROXYPASSWORD, opt.proxy_password.c_str());
+                Buffer buf(*it);
+                if (boost::asio::buffer_size(buf) > 0)
+                    return buf;
             }
-            ::curl_easy_setopt(handle_, CURLOPT_PROXYPORT, opt.proxy_port);
-            ::curl_easy_setopt(handle_, CURLOPT_PROXYTYPE, opt.proxy_type);
-            if (opt.accept_all_supported_encodings)
-                ::curl_easy_setopt(handle_, CURLOPT_ACCEPT_ENCODING, "");
-            else
-                ::curl_easy_setopt(handle_, CURLOPT_ACCEPT_ENCODING, opt.accept_encoding.empty() ? NULL : opt.accept_encoding.c_str());
-            if (!opt.referer.empty())
-                ::curl_easy_setopt(handle_, CURLOPT_REFERER, opt.referer.c_str());
-            if (!opt.useragent.empty())
-                ::curl_easy_setopt(handle_, CURLOPT_USERAGENT, opt.useragent.c_str());
-            if (!opt.http_header.empty())
+            return Buffer();
+        }
+        
+        void read(boost::asio::mutable_buffer buffer, io_handler handler, const boost::system::error_code& err)
+        {
+            if (err || !open_)
             {
-                for (std::list<std::string>::const_iterator it(opt.http_header.begin()); it != opt.http_header.end(); ++it)
-                {
-                    curl_slist *new_list = ::curl_slist_append(httpheader_, it->c_str());
-                    if (!new_list)
-                        return false;
-                    httpheader_ = new_list;
-                }
-                
-                ::curl_easy_setopt(handle_, CURLOPT_HTTPHEADER, httpheader_);
+                strand_.post(boost::bind(handler, err ? err : boost::asio::error::not_connected, 0));
+                return;
             }
             
-            if (!opt.interface.empty())
-                ::curl_easy_setopt(handle_, CURLOPT_INTERFACE, ("if!" + opt.interface).c_str());
-            
-            ::curl_easy_setopt(handle_, CURLOPT_WRITEFUNCTION, curl_write_function);
-            ::curl_easy_setopt(handle_, CURLOPT_WRITEDATA, this);
-            
-            ::curl_easy_setopt(handle_, CURLOPT_READFUNCTION, curl_read_function);
-            ::curl_easy_setopt(handle_, CURLOPT_READDATA, this);
-            
-            ::curl_easy_setopt(handle_, CURLOPT_HEADERFUNCTION, curl_header_function);
-            ::curl_easy_setopt(handle_, CURLOPT_HEADERDATA, this);
+            std::size_t size = boost::asio::buffer_size(buffer);
+            if (size == 0)
+            {
+                strand_.post(boost::bind(handler, boost::system::error_code(), 0));
+                return;
+            }
             
-            url_ = uri;
-            return true;
+            std::size_t received = 0;
+            CURLcode rc = ::curl_easy_recv(handle(), boost::asio::buffer_cast<void*>(buffer), size, &received);
+            if (rc == CURLE_AGAIN)
+                async_wait(CURL_POLL_IN, boost::bind(&connect_stream::read, self(), buffer, handler, _1));
+            else if (rc != CURLE_OK)
+                strand_.post(boost::bind(handler, make_error_code(rc), 0));
+            else if (received == 0)
+                strand_.post(boost::bind(handler, boost::asio::error::eof, 0));
+            else
+                strand_.post(boost::bind(handler, boost::system::error_code(), received));
         }
         
-        bool init()
+        void write(boost::asio::const_buffer buffer, io_handler handler, const boost::system::error_code& err)
         {
-            CURL_ASIO_LOGSCOPE("transfer::init", this);
-            
-            if (handle_)
-                ::curl_easy_reset(handle_);
-            else
+            if (err || !open_)
             {
-                handle_ = ::curl_easy_init();
-                if (!handle_)
-                    return false;
+                strand_.post(boost::bind(handler, err ? err : boost::asio::error::not_connected, 0));
+                return;
             }
             
-            if (httpheader_)
+            std::size_t size = boost::asio::buffer_size(buffer);
+            if (size == 0)
             {
-                ::curl_slist_free_all(httpheader_);
-                httpheader_ = NULL;
+                strand_.post(boost::bind(handler, boost::system::error_code(), 0));
+                return;
             }
             
-            ::curl_easy_setopt(handle_, CURLOPT_PRIVATE, this);
-            ::curl_easy_setopt(handle_, CURLOPT_NOSIGNAL, 1l);
-            return true;
+            std::size_t sent = 0;
+            CURLcode rc = ::curl_easy_send(handle(), boost::asio::buffer_cast<const void*>(buffer), size, &sent);
+            if (rc == CURLE_AGAIN)
+                async_wait(CURL_POLL_OUT, boost::bind(&connect_stream::write, self(), buffer, handler, _1));
+            else if (rc != CURLE_OK)
+                strand_.post(boost::bind(handler, make_error_code(rc), 0));
+            else
+                strand_.post(boost::bind(handler, boost::system::error_code(), sent));
         }
+    };
+    
+#if LIBCURL_VERSION_NUM >= 0x075600
+    class websocket: public connection
+    {
+    public:
+        typedef boost::shared_ptr<websocket> ptr;
+        typedef boost::function<void(CURLcode, std::size_t, int, curl_off_t)> receive_handler;
+        typedef boost::function<void(CURLcode, std::size_t)> send_handler;
         
-        void terminate()
+        static inline ptr create(transfer::ptr trans)
         {
-            impl_.reset();
+            if (trans->shares_options())
+                return ptr();
+            
+            return ptr(new websocket(trans));
         }
         
-        void lock() { lock_ = shared_from_this(); }
-        void unlock() { lock_.reset(); }
+        void async_receive(const boost::asio::mutable_buffer& buffer, const receive_handler& handler)
+        {
+            receive(buffer, handler, boost::system::error_code());
+        }
         
-        void handle_done(CURLcode result)
+        void async_send(const boost::asio::const_buffer& buffer, int flags, const send_handler& handler)
         {
-            CURL_ASIO_LOG("transfer::handle_done: result=" << result);
-            if (on_done)
-                on_done(result);
-            running_ = false;
+            send(buffer, flags, 0, handler, boost::system::error_code());
         }
         
-        size_t write_function(char *ptr, size_t size)
+    private:
+        websocket(transfer::ptr trans)
+            : connection(trans, 2l)
         {
-            if (impl_ && on_data_read)
-            {
-                callback_protector protector(callback_recursions_);
-                data_action::type action = on_data_read(boost::asio::const_buffer(ptr, size));
-                
-                if (!running_)
-                    return 0;
-                
-                switch (action)
-                {
-                    case data_action::success:
-                        return size;
-                    case data_action::pause:
-                        return CURL_WRITEFUNC_PAUSE;
-                    case data_action::abort:
-                    default:
-                        break;
-                }
-            }
-            
-            return 0;
         }
         
-        static inline size_t curl_write_function(char *ptr, size_t size, size_t nmemb, void *userdata)
+        ptr self()
         {
-            CURL_ASIO_LOGSCOPE("transfer::curl_write_function", userdata);
-            return from_ptr(userdata)->write_function(ptr, size * nmemb);
+            return boost::static_pointer_cast<websocket>(shared_from_this());
         }
         
-        size_t read_function(void *ptr, size_t size)
+        void receive(boost::asio::mutable_buffer buffer, receive_handler handler, const boost::system::error_code& err)
         {
-            if (impl_ && on_data_write)
+            if (err || !open_)
             {
-                callback_protector protector(callback_recursions_);
-                boost::asio::mutable_buffer buf(ptr, size);
-                data_action::type action = on_data_write(buf);
-                
-                if (!running_)
-                    return CURL_READFUNC_ABORT;
-                
-                switch (action)
-                {
-                    case data_action::success:
-                        return size - boost::asio::buffer_size(buf);
-                    case data_action::pause:
-                        return CURL_READFUNC_PAUSE;
-                    case data_action::abort:
-                    default:
-                        break;
-                }
+                strand_.post(boost::bind(handler, CURLE_RECV_ERROR, 0, 0, 0));
+                return;
             }
             
-            return CURL_READFUNC_ABORT;
+            std::size_t received = 0;
+            int flags = 0;
+            curl_off_t bytesleft = 0;
+            CURLcode rc = ws_recv(&::curl_ws_recv, handle(), buffer, received, flags, bytesleft);
+            if (rc == CURLE_AGAIN)
+                async_wait(CURL_POLL_IN, boost::bind(&websocket::receive, self(), buffer, handler, _1));
+            else
+                strand_.post(boost::bind(handler, rc, received, flags, bytesleft));
         }
         
-        static inline size_t curl_read_function(void *ptr, size_t size, size_t nmemb, void *userdata)
+        template <typename Frame>
+        static inline CURLcode ws_recv(CURLcode (*recv)(CURL*, void*, size_t, size_t*, Frame**), CURL *easy, const boost::asio::mutable_buffer& buffer, std::size_t& received, int& flags, curl_off_t& bytesleft)
         {
-            CURL_ASIO_LOGSCOPE("transfer::curl_read_function", userdata);
-            return from_ptr(userdata)->read_function(ptr, size * nmemb);
+            Frame *meta = NULL;
+            CURLcode rc = recv(easy, boost::asio::buffer_cast<void*>(buffer), boost::asio::buffer_size(buffer), &received, &meta);
+            if (meta)
+            {
+                flags = meta->flags;
+                bytesleft = meta->bytesleft;
+            }
+            return rc;
         }
         
-        size_t header_function(const char *ptr, size_t size)
+        void send(boost::asio::const_buffer buffer, int flags, std::size_t sent, send_handler handler, const boost::system::error_code& err)
         {
-            if (impl_)
+            if (err || !open_)
             {
-                if (on_header)
-                {
-                    callback_protector protector(callback_recursions_);
-                    header_action::type action = on_header(std::string(ptr, size));
-                    
-                    if (!running_)
-                        return 0;
-                    
-                    switch (action)
-                    {
-                        case header_action::success:
-                            return size;
-                        case header_action::abort:
-                        default:
-                            break;
-                    }
-                }
-                else
-                    return size;
+                strand_.post(boost::bind(handler, CURLE_SEND_ERROR, sent));
+                return;
             }
             
-            return 0;
-        }
-        
-        static inline size_t curl_header_function(void *ptr, size_t size, size_t nmemb, void *userdata)
-        {
-            CURL_ASIO_LOGSCOPE("transfer::curl_header_function", userdata);
-            return from_ptr(userdata)->header_function(static_cast<const char*>(ptr), size * nmemb);
+            const char *data = boost::asio::buffer_cast<const char*>(buffer);
+            std::size_t size = boost::asio::buffer_size(buffer);
+            std::size_t n = 0;
+            curl_off_t fragsize = sent ? 0 : static_cast<curl_off_t>(size);
+            CURLcode rc = ::curl_ws_send(handle(), data + sent, size - sent, &n, fragsize, flags | CURLWS_OFFSET);
+            sent += n;
+            if (rc == CURLE_AGAIN || (rc == CURLE_OK && sent < size))
+                async_wait(CURL_POLL_OUT, boost::bind(&websocket::send, self(), buffer, flags, sent, handler, _1));
+            else
+                strand_.post(boost::bind(handler, rc, sent));
         }
     };
+#endif
     
 private:
     boost::shared_ptr<implementation> impl_;
@@ -753,7 +5306,7 @@ private:
             CURL_ASIO_LOGSCOPE("tcpsocketinfo::cancel", this);
 #ifdef __CURL_ASIO_CANCEL_WORKAROUND
             boost::shared_ptr<boost::asio::ip::tcp::socket> old(sock_);
-            sock_.reset(new boost::asio::ip::tcp::socket(old->get_io_service()));
+            sock_.reset(new boost::asio::ip::tcp::socket(io_service_of(*old)));
             sock_->assign(version_, dup_handle(old->native_handle()));
             old->close();
 #else
@@ -795,7 +5348,7 @@ private:
         {
 #ifdef __CURL_ASIO_CANCEL_WORKAROUND
             boost::shared_ptr<boost::asio::ip::udp::socket> old(sock_);
-            sock_.reset(new boost::asio::ip::udp::socket(old->get_io_service()));
+            sock_.reset(new boost::asio::ip::udp::socket(io_service_of(*old)));
             sock_->assign(version_, dup_handle(old->native_handle()));
             old->close();
 #else
@@ -834,6 +5387,8 @@ private:
         
         virtual ~implementation()
         {
+            ::curl_multi_setopt(curl_, CURLMOPT_SOCKETFUNCTION, NULL);
+            ::curl_multi_setopt(curl_, CURLMOPT_TIMERFUNCTION, NULL);
             ::curl_multi_cleanup(curl_);
         }
         
@@ -873,6 +5428,27 @@ private:
             return false;
         }
         
+        boost::asio::io_service& get_io_service()
+        {
+            return io_service_of(timer_);
+        }
+        
+        boost::asio::io_service::strand& get_strand()
+        {
+            return strand_;
+        }
+        
+        memory_budget& get_budget()
+        {
+            return *budget_;
+        }
+        
+        template <typename Handler>
+        void post(Handler handler)
+        {
+            strand_.post(handler);
+        }
+        
         bool remove_transfer(boost::shared_ptr<transfer> trans)
         {
             CURLMcode rc = ::curl_multi_remove_handle(curl_, trans->handle_);
@@ -894,7 +5470,10 @@ private:
         friend class transfer;
         friend class socketinfo;
         
+        global_init global_;
         boost::asio::deadline_timer timer_;
+        boost::asio::io_service::strand strand_;
+        boost::shared_ptr<memory_budget> budget_;
         unsigned int callback_recursions_;
         socketinfo_map_t sockets_;
         transfer_set_t transfers_;
@@ -909,13 +5488,20 @@ private:
         }
         
         implementation(boost::asio::io_service& io)
-            : timer_(io),
+            : global_(global_init::attach_existing()),
+              timer_(io),
+              strand_(io),
+              budget_(new memory_budget(strand_)),
               callback_recursions_(0),
               running_(0),
               terminated_(false)
         {
+            if (!global_.ok())
+                throw boost::system::system_error(make_error_code(CURLE_FAILED_INIT), "curl_global_init");
+            
             curl_ = ::curl_multi_init();
-            assert(curl_);
+            if (!curl_)
+                throw boost::system::system_error(make_error_code(CURLE_OUT_OF_MEMORY), "curl_multi_init");
             
             ::curl_multi_setopt(curl_, CURLMOPT_SOCKETFUNCTION, curl_socket_function);
             ::curl_multi_setopt(curl_, CURLMOPT_SOCKETDATA, this);
@@ -933,7 +5519,9 @@ private:
                     CURLcode code = msg->data.result;
                     boost::shared_ptr<transfer> trans(transfer::from_easy(msg->easy_handle));
                     assert(trans);
-                    if (!remove_transfer(trans))
+                    if (code == CURLE_OK && trans->opt.connect_only)
+                        trans->connected_ = true;
+                    else if (!remove_transfer(trans))
                     {
                         CURL_ASIO_LOG("Could not remove easy handle");
                     }
@@ -953,10 +5541,10 @@ private:
             }
             
             if (action & CURL_POLL_IN)
-                sock->async_wait_read(boost::bind(&implementation::async_wait_complete, shared_from_this(), boost::asio::placeholders::error, s, CURL_POLL_IN, sock));
+                sock->async_wait_read(strand_.wrap(boost::bind(&implementation::async_wait_complete, shared_from_this(), boost::asio::placeholders::error, s, CURL_POLL_IN, sock)));
             
             if (action & CURL_POLL_OUT)
-                sock->async_wait_write(boost::bind(&implementation::async_wait_complete, shared_from_this(), boost::asio::placeholders::error, s, CURL_POLL_OUT, sock));
+                sock->async_wait_write(strand_.wrap(boost::bind(&implementation::async_wait_complete, shared_from_this(), boost::asio::placeholders::error, s, CURL_POLL_OUT, sock)));
         }
         
         void async_wait_complete(const boost::system::error_code &err, curl_socket_t s, int action, boost::shared_ptr<socketinfo> sock)
@@ -973,7 +5561,11 @@ private:
                     process_curl_messages();
                     
                     if (running_ > 0)
-                        async_wait(s, action, sock);
+                    {
+                        socketinfo_map_t::const_iterator it(sockets_.find(s));
+                        if (it != sockets_.end() && it->second == sock)
+                            async_wait(s, action, sock);
+                    }
                     else
                         sock->cancel();
                 }
@@ -1000,7 +5592,7 @@ private:
             {
                 if (!sock)
                 {
-                    sock = socketinfo::create(timer_.get_io_service(), s);
+                    sock = socketinfo::create(io_service_of(timer_), s);
                     assert(it == sockets_.end());
                 }
                 
@@ -1042,15 +5634,10 @@ private:
         {
             timer_.cancel();
             
-            if (timeout_ms > 0)
+            if (timeout_ms >= 0)
             {
                 timer_.expires_from_now(boost::posix_time::milliseconds(timeout_ms));
-                timer_.async_wait(boost::bind(&implementation::timer_handler, shared_from_this(), boost::asio::placeholders::error));
-            }
-            else
-            {
-                boost::system::error_code err;
-                timer_handler(err);
+                timer_.async_wait(strand_.wrap(boost::bind(&implementation::timer_handler, shared_from_this(), boost::asio::placeholders::error)));
             }
             
             return 0;
@@ -1065,6 +5652,7 @@ private:
 };
 
 #undef __CURL_ASIO_CANCEL_WORKAROUND
+#undef CURL_ASIO_THREAD_LOCAL
 
 #endif
 
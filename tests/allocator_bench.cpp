@@ -0,0 +1,208 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+#include <cstring>
+#include <iomanip>
+
+#include <sys/wait.h>
+#include <time.h>
+
+enum
+{
+    threads = 4,
+    warmup_requests = 200,
+    requests_per_thread = 2000
+};
+
+static curl_asio::memory_hooks inner;
+static boost::atomic<boost::uint64_t> hook_calls(0);
+static boost::atomic<boost::uint64_t> hook_ns(0);
+
+static inline boost::uint64_t now_ns()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<boost::uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+}
+
+static inline void account(boost::uint64_t start)
+{
+    hook_ns.fetch_add(now_ns() - start, boost::memory_order_relaxed);
+    hook_calls.fetch_add(1, boost::memory_order_relaxed);
+}
+
+static void *timed_malloc(size_t size)
+{
+    boost::uint64_t start = now_ns();
+    void *ret = inner.malloc_function(size);
+    account(start);
+    return ret;
+}
+
+static void timed_free(void *ptr)
+{
+    boost::uint64_t start = now_ns();
+    inner.free_function(ptr);
+    account(start);
+}
+
+static void *timed_realloc(void *ptr, size_t size)
+{
+    boost::uint64_t start = now_ns();
+    void *ret = inner.realloc_function(ptr, size);
+    account(start);
+    return ret;
+}
+
+static char *timed_strdup(const char *str)
+{
+    boost::uint64_t start = now_ns();
+    char *ret = inner.strdup_function(str);
+    account(start);
+    return ret;
+}
+
+static void *timed_calloc(size_t count, size_t size)
+{
+    boost::uint64_t start = now_ns();
+    void *ret = inner.calloc_function(count, size);
+    account(start);
+    return ret;
+}
+
+static curl_asio::memory_hooks libc_hooks()
+{
+    curl_asio::memory_hooks ret;
+    ret.malloc_function = std::malloc;
+    ret.free_function = std::free;
+    ret.realloc_function = std::realloc;
+    ret.strdup_function = ::strdup;
+    ret.calloc_function = std::calloc;
+    return ret;
+}
+
+static curl_asio::memory_hooks timed_hooks()
+{
+    curl_asio::memory_hooks ret;
+    ret.malloc_function = timed_malloc;
+    ret.free_function = timed_free;
+    ret.realloc_function = timed_realloc;
+    ret.strdup_function = timed_strdup;
+    ret.calloc_function = timed_calloc;
+    return ret;
+}
+
+struct client
+{
+    curl_asio *curl;
+    curl_asio::transfer::ptr trans;
+    std::string url;
+    int remaining;
+    bool failed;
+};
+
+static curl_asio::data_action::type discard(const boost::asio::const_buffer&)
+{
+    return curl_asio::data_action::success;
+}
+
+static void start(client *c)
+{
+    if (!c->trans->start(c->url))
+        c->failed = true;
+}
+
+static void on_done(client *c, CURLcode result)
+{
+    if (result != CURLE_OK)
+        c->failed = true;
+    else if (--c->remaining > 0)
+        c->curl->get_strand().post(boost::bind(start, c));
+}
+
+static void run_client(const std::string& url, int count, bool *failed)
+{
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    client c;
+    c.curl = &curl;
+    c.trans = curl.create_transfer();
+    c.trans->on_data_read = discard;
+    c.trans->on_done = boost::bind(on_done, &c, _1);
+    c.url = url;
+    c.remaining = count;
+    c.failed = false;
+    
+    curl.get_strand().post(boost::bind(start, &c));
+    io.run();
+    *failed = c.failed || c.remaining != 0;
+}
+
+static bool run_clients(const std::string& url, int count)
+{
+    bool failed[threads];
+    boost::thread_group pool;
+    for (int i = 0; i < threads; ++i)
+        pool.create_thread(boost::bind(run_client, url, count, &failed[i]));
+    pool.join_all();
+    
+    for (int i = 0; i < threads; ++i)
+    {
+        if (failed[i])
+            return false;
+    }
+    return true;
+}
+
+static int measure(const char *name, const curl_asio::memory_hooks& hooks)
+{
+    inner = hooks;
+    if (!curl_asio::global_init_mem(timed_hooks()))
+        return 1;
+    
+    keep_alive_server server;
+    if (!run_clients(server.url("/ping"), warmup_requests))
+        return 1;
+    
+    hook_calls = 0;
+    hook_ns = 0;
+    boost::uint64_t start = now_ns();
+    if (!run_clients(server.url("/ping"), requests_per_thread))
+        return 1;
+    double wall_ns = static_cast<double>(now_ns() - start);
+    
+    const double requests = threads * requests_per_thread;
+    std::cout << std::setw(12) << name << std::fixed << std::setprecision(1)
+              << std::setw(8) << hook_calls / requests << " calls,"
+              << std::setw(8) << hook_ns / requests / 1000 << " us in the allocator,"
+              << std::setw(8) << wall_ns / requests / 1000 << " us wall per request" << std::endl;
+    return 0;
+}
+
+static bool run_forked(const char *name, const curl_asio::memory_hooks& hooks)
+{
+    std::cout.flush();
+    pid_t pid = ::fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0)
+    {
+        int rc = measure(name, hooks);
+        std::cout.flush();
+        ::_exit(rc);
+    }
+    
+    int status = 0;
+    return ::waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main()
+{
+    std::cout << "allocator_bench: " << threads << " threads, " << requests_per_thread << " sequential keep-alive requests each; every libcurl allocator call is timed, including two clock reads" << std::endl;
+    if (!run_forked("malloc", libc_hooks()) || !run_forked("pool", curl_asio::pool_allocator::hooks()))
+    {
+        std::cerr << "allocator_bench: a run failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
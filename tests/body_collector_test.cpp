@@ -0,0 +1,149 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+#include <fstream>
+
+#include <dirent.h>
+
+enum
+{
+    spill_memory_limit = 16 * 1024,
+    spill_body_size = 300 * 1024 + 17
+};
+
+static std::string spill_body()
+{
+    std::string ret;
+    ret.reserve(spill_body_size);
+    unsigned long seed = 12345;
+    while (ret.size() < spill_body_size)
+    {
+        seed = seed * 1103515245ul + 12345ul;
+        ret.push_back(static_cast<char>(seed >> 16));
+    }
+    return ret;
+}
+
+static test_server::script body(const std::string& path)
+{
+    if (path == "/spill")
+        return test_server::respond(spill_body());
+    return test_server::respond(std::string(path == "/first" ? 1000 : 3000, 'x'));
+}
+
+static int open_spill_files()
+{
+    int ret = 0;
+    DIR *dir = ::opendir("/proc/self/fd");
+    if (!dir)
+        return -1;
+    while (struct dirent *entry = ::readdir(dir))
+    {
+        std::string link("/proc/self/fd/");
+        link += entry->d_name;
+        char target[4096];
+        ssize_t n = ::readlink(link.c_str(), target, sizeof(target) - 1);
+        if (n > 0 && std::string(target, n).find("/curl_asio.") != std::string::npos)
+            ++ret;
+    }
+    ::closedir(dir);
+    return ret;
+}
+
+static int mapped_spill_files()
+{
+    int ret = 0;
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while (std::getline(maps, line))
+    {
+        if (line.find("/curl_asio.") != std::string::npos)
+            ++ret;
+    }
+    return ret;
+}
+
+static int spilled_results = 0;
+static std::string spilled_body;
+static int spill_fds_at_done = -1;
+static int spill_maps_at_done = -1;
+
+static void on_spilled(CURLcode result, const boost::asio::const_buffer& buffer)
+{
+    ++spilled_results;
+    CHECK(result == CURLE_OK);
+    spilled_body.assign(boost::asio::buffer_cast<const char*>(buffer), boost::asio::buffer_size(buffer));
+    spill_fds_at_done = open_spill_files();
+    spill_maps_at_done = mapped_spill_files();
+}
+
+static int collected = 0;
+static std::size_t collected_size = 0;
+static int restarted = 0;
+
+static void on_restarted(CURLcode)
+{
+    ++restarted;
+}
+
+static void restart(curl_asio::transfer *trans, const std::string& url)
+{
+    trans->on_done = on_restarted;
+    CHECK(trans->start(url));
+}
+
+static void on_collected(boost::asio::io_service *io, curl_asio::transfer *trans, const std::string& url, CURLcode result, const boost::asio::const_buffer& buffer)
+{
+    ++collected;
+    collected_size = boost::asio::buffer_size(buffer);
+    CHECK(result == CURLE_OK);
+    io->post(boost::bind(restart, trans, url));
+}
+
+int main()
+{
+    test_watchdog(30);
+    test_server server(body);
+    
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    
+    curl_asio::transfer::ptr trans(curl.create_transfer());
+    curl_asio::body_collector::ptr collector(curl_asio::body_collector::create(trans));
+    collector->on_done = boost::bind(on_collected, &io, trans.get(), server.url("/second"), _1, _2);
+    CHECK(trans->start(server.url("/first")));
+    
+    io.run();
+    
+    CHECK(collected == 1);
+    CHECK(collected_size == 1000);
+    CHECK(restarted == 1);
+    CHECK(collector->size() == 1000);
+    
+    CHECK(open_spill_files() == 0);
+    CHECK(mapped_spill_files() == 0);
+    {
+        curl_asio::transfer::ptr spilling(curl.create_transfer());
+        curl_asio::body_collector::ptr spill(curl_asio::body_collector::create(spilling, spill_memory_limit));
+        spill->on_done = on_spilled;
+        CHECK(spilling->start(server.url("/spill")));
+        io.reset();
+        io.run();
+        
+        CHECK(spilled_results == 1);
+        CHECK(spill->spilled());
+        CHECK(spill->error() == 0);
+        CHECK(spill->size() == spill_body_size);
+        CHECK(spilled_body.size() == spill_body_size);
+        CHECK(spilled_body == spill_body());
+        CHECK(spill_fds_at_done == 0);
+        CHECK(spill_maps_at_done == 1);
+        
+        boost::weak_ptr<curl_asio::body_collector> released(spill);
+        spill.reset();
+        CHECK(released.expired());
+    }
+    CHECK(open_spill_files() == 0);
+    CHECK(mapped_spill_files() == 0);
+    return test_result("body_collector_test");
+}
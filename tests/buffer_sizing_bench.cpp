@@ -0,0 +1,121 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+#include <fstream>
+#include <iomanip>
+
+enum
+{
+    bulk_size = 32 * 1024 * 1024,
+    bulk_runs = 5,
+    idle_streams = 200
+};
+
+static test_server::script body(const std::string& path)
+{
+    if (path == "/bulk")
+        return test_server::respond(std::string(bulk_size, 'x'));
+    
+    test_server::script steps;
+    steps.push_back(test_server::step(0, std::string()));
+    steps.push_back(test_server::step(1500, std::string(1024, 'x')));
+    return test_server::respond(steps);
+}
+
+struct memory_usage
+{
+    double size_kb;
+    double resident_kb;
+};
+
+static memory_usage current_memory()
+{
+    std::ifstream statm("/proc/self/statm");
+    long size = 0, resident = 0;
+    statm >> size >> resident;
+    memory_usage ret;
+    ret.size_kb = size * (::sysconf(_SC_PAGESIZE) / 1024.0);
+    ret.resident_kb = resident * (::sysconf(_SC_PAGESIZE) / 1024.0);
+    return ret;
+}
+
+static curl_asio::data_action::type discard(const boost::asio::const_buffer&)
+{
+    return curl_asio::data_action::success;
+}
+
+static void stop_io(boost::asio::io_service *io, const boost::system::error_code&)
+{
+    io->stop();
+}
+
+static double bulk_throughput(curl_asio::buffer_sizing::type profile, const std::string& url)
+{
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    curl_asio::transfer::ptr trans(curl.create_transfer());
+    trans->opt.buffer_profile = profile;
+    trans->on_data_read = discard;
+    
+    double speed = 0;
+    for (int run = 0; run < bulk_runs; ++run)
+    {
+        if (!trans->start(url))
+            return 0;
+        io.run();
+        io.reset();
+        speed = static_cast<double>(trans->info().speed_download());
+    }
+    return speed / (1024 * 1024);
+}
+
+static memory_usage idle_memory(curl_asio::buffer_sizing::type profile, const std::string& url)
+{
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    std::vector<curl_asio::transfer::ptr> transfers;
+    
+    memory_usage before(current_memory());
+    for (int i = 0; i < idle_streams; ++i)
+    {
+        curl_asio::transfer::ptr trans(curl.create_transfer());
+        trans->opt.buffer_profile = profile;
+        trans->on_data_read = discard;
+        if (trans->start(url))
+            transfers.push_back(trans);
+    }
+    
+    boost::asio::deadline_timer timer(io);
+    timer.expires_from_now(boost::posix_time::milliseconds(1000));
+    timer.async_wait(boost::bind(stop_io, &io, _1));
+    io.run();
+    
+    memory_usage after(current_memory());
+    after.size_kb = (after.size_kb - before.size_kb) / transfers.size();
+    after.resident_kb = (after.resident_kb - before.resident_kb) / transfers.size();
+    return after;
+}
+
+int main()
+{
+    test_server server(body);
+    
+    static const char *names[] = { "standard", "bulk", "low_memory", "adaptive" };
+    static const curl_asio::buffer_sizing::type profiles[] = { curl_asio::buffer_sizing::standard, curl_asio::buffer_sizing::bulk, curl_asio::buffer_sizing::low_memory, curl_asio::buffer_sizing::adaptive };
+    
+    idle_memory(curl_asio::buffer_sizing::standard, server.url("/idle"));
+    
+    const std::size_t count = sizeof(profiles) / sizeof(profiles[0]);
+    std::vector<memory_usage> memory;
+    for (std::size_t i = 0; i < count; ++i)
+        memory.push_back(idle_memory(profiles[i], server.url("/idle")));
+    
+    std::cout << "buffer_sizing_bench: " << bulk_size / (1024 * 1024) << " MB bulk download (run " << bulk_runs << " of one transfer), " << idle_streams << " open streams" << std::endl;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        double speed = bulk_throughput(profiles[i], server.url("/bulk"));
+        std::cout << std::setw(12) << names[i] << std::fixed << std::setprecision(1)
+                  << std::setw(10) << speed << " MB/s, per open stream" << std::setw(8) << memory[i].size_kb << " KB allocated" << std::setw(8) << memory[i].resident_kb << " KB resident" << std::endl;
+    }
+    return 0;
+}
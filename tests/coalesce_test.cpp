@@ -0,0 +1,58 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+static test_server::script trickle(const std::string&)
+{
+    test_server::script steps;
+    steps.push_back(test_server::step(0, test_server::chunk(std::string(100, 'a'))));
+    steps.push_back(test_server::step(50, test_server::chunk(std::string(2000, 'b')) + test_server::chunk(std::string(100, 'c'))));
+    steps.push_back(test_server::step(2000, test_server::chunk(std::string(10, 'd'))));
+    return test_server::respond_chunked(steps);
+}
+
+static boost::posix_time::ptime started;
+static std::size_t received = 0;
+static boost::posix_time::time_duration third_batch_at;
+static bool done = false;
+static CURLcode done_result = CURLE_OK;
+
+static curl_asio::data_action::type on_data(const boost::asio::const_buffer& buffer)
+{
+    received += boost::asio::buffer_size(buffer);
+    if (received >= 2200 && third_batch_at.is_not_a_date_time())
+        third_batch_at = boost::posix_time::microsec_clock::universal_time() - started;
+    return curl_asio::data_action::success;
+}
+
+static void on_done(CURLcode result)
+{
+    done = true;
+    done_result = result;
+}
+
+int main()
+{
+    test_watchdog(30);
+    test_server server(trickle);
+    
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    
+    third_batch_at = boost::posix_time::not_a_date_time;
+    curl_asio::transfer::ptr trans(curl.create_transfer());
+    trans->opt.coalesce_size = 1024;
+    trans->opt.coalesce_timeout_ms = 100;
+    trans->on_data_read = on_data;
+    trans->on_done = on_done;
+    started = boost::posix_time::microsec_clock::universal_time();
+    CHECK(trans->start(server.url("/trickle")));
+    
+    io.run();
+    
+    CHECK(done);
+    CHECK(done_result == CURLE_OK);
+    CHECK(received == 2210);
+    CHECK(!third_batch_at.is_not_a_date_time());
+    CHECK(third_batch_at < boost::posix_time::milliseconds(1000));
+    return test_result("coalesce_test");
+}
@@ -0,0 +1,148 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+#include <iomanip>
+
+#include <sys/resource.h>
+
+#if defined(CURL_ASIO_ENABLE_ZLIB) || defined(CURL_ASIO_ENABLE_ZSTD)
+
+enum
+{
+    body_size = 64 * 1024 * 1024,
+    upload_buffer_size = 64 * 1024
+};
+
+static std::string make_body()
+{
+    static const char *levels[] = { "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char *paths[] = { "/api/v1/items", "/api/v1/users", "/static/app.js", "/healthz" };
+    
+    std::string body;
+    body.reserve(body_size + 256);
+    unsigned long seed = 12345;
+    while (body.size() < body_size)
+    {
+        seed = seed * 1103515245ul + 12345ul;
+        std::ostringstream line;
+        line << "{\"ts\":" << 1700000000 + body.size() / 97 << ",\"level\":\"" << levels[(seed >> 8) & 3]
+             << "\",\"path\":\"" << paths[(seed >> 12) & 3] << "\",\"status\":" << 200 + ((seed >> 16) % 5) * 100
+             << ",\"bytes\":" << (seed >> 4) % 100000 << ",\"req\":\"" << std::hex << seed << "\"}\n";
+        body += line.str();
+    }
+    body.resize(body_size);
+    return body;
+}
+
+struct body_source
+{
+    const std::string *body;
+    std::size_t pos;
+};
+
+static curl_asio::data_action::type read_body(body_source *source, boost::asio::mutable_buffer& buf)
+{
+    std::size_t n = boost::asio::buffer_copy(buf, boost::asio::buffer(source->body->data() + source->pos, source->body->size() - source->pos));
+    source->pos += n;
+    buf = buf + n;
+    return curl_asio::data_action::success;
+}
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+struct result
+{
+    double cpu;
+    double wall;
+    curl_off_t bytes_out;
+};
+
+static bool pump(const std::string& body, bool compress, curl_asio::body_compressor::encoding::type enc, int level, result& r)
+{
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    curl_asio::transfer::ptr trans(curl.create_transfer());
+    body_source source = { &body, 0 };
+    trans->on_data_write = boost::bind(read_body, &source, _1);
+    
+    curl_asio::body_compressor::ptr compressor;
+    if (compress)
+    {
+        compressor = curl_asio::body_compressor::create(trans, enc, level);
+        if (!compressor)
+            return false;
+    }
+    
+    std::vector<char> out(upload_buffer_size);
+    r.bytes_out = 0;
+    double cpu = cpu_seconds();
+    boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+    for (;;)
+    {
+        boost::asio::mutable_buffer buf(boost::asio::buffer(out));
+        if (trans->on_data_write(buf) != curl_asio::data_action::success)
+            return false;
+        std::size_t n = out.size() - boost::asio::buffer_size(buf);
+        if (n == 0)
+            break;
+        r.bytes_out += n;
+    }
+    r.wall = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+    r.cpu = cpu_seconds() - cpu;
+    return !compressor || compressor->bytes_in() == static_cast<curl_off_t>(body.size());
+}
+
+int main()
+{
+    std::string body(make_body());
+    
+    struct variant
+    {
+        const char *name;
+        bool compress;
+        curl_asio::body_compressor::encoding::type enc;
+        int level;
+    };
+    static const variant variants[] = {
+        { "identity", false, curl_asio::body_compressor::encoding::gzip, 0 },
+#ifdef CURL_ASIO_ENABLE_ZLIB
+        { "gzip -1", true, curl_asio::body_compressor::encoding::gzip, 1 },
+        { "gzip -6", true, curl_asio::body_compressor::encoding::gzip, 6 },
+#endif
+#ifdef CURL_ASIO_ENABLE_ZSTD
+        { "zstd -1", true, curl_asio::body_compressor::encoding::zstd, 1 },
+        { "zstd -3", true, curl_asio::body_compressor::encoding::zstd, 3 },
+#endif
+    };
+    
+    std::cout << "compression_bench: " << body_size / (1024 * 1024) << " MB of JSON log lines through on_data_write in " << upload_buffer_size / 1024 << " KB reads" << std::endl;
+    for (std::size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i)
+    {
+        result r = result();
+        if (!pump(body, variants[i].compress, variants[i].enc, variants[i].level, r))
+        {
+            std::cerr << "compression_bench: " << variants[i].name << " failed" << std::endl;
+            return 1;
+        }
+        std::cout << std::setw(12) << variants[i].name << std::fixed << std::setprecision(1)
+                  << std::setw(10) << body_size / (1024 * 1024) / r.wall << " MB/s in,"
+                  << std::setw(8) << r.cpu * 1e3 / (body_size / (1024 * 1024)) << " ms CPU per MB,"
+                  << std::setw(8) << 100.0 * r.bytes_out / body_size << "% of input on the wire" << std::endl;
+    }
+    return 0;
+}
+
+#else
+
+int main()
+{
+    std::cout << "compression_bench: skipped, build with CURL_ASIO_ENABLE_ZLIB or CURL_ASIO_ENABLE_ZSTD" << std::endl;
+    return 0;
+}
+
+#endif
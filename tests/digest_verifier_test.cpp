@@ -0,0 +1,68 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+static test_server::script hello(const std::string&)
+{
+    return test_server::respond("hello world");
+}
+
+static std::size_t received = 0;
+static std::vector<CURLcode> results;
+
+static curl_asio::data_action::type on_data(const boost::asio::const_buffer& buffer)
+{
+    received += boost::asio::buffer_size(buffer);
+    return curl_asio::data_action::success;
+}
+
+static void on_done(CURLcode result)
+{
+    results.push_back(result);
+}
+
+int main()
+{
+    test_watchdog(30);
+    test_server server(hello);
+    
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    
+    curl_asio::transfer::ptr trans(curl.create_transfer());
+    trans->on_data_read = on_data;
+    trans->on_done = on_done;
+    curl_asio::digest_verifier::ptr verifier(curl_asio::digest_verifier::create(trans, curl_asio::digest_verifier::algorithm::crc32c, "00000000"));
+    CHECK(trans->start(server.url("/hello")));
+    io.run();
+    
+    CHECK(results.size() == 1);
+    CHECK(!results.empty() && results.back() == CURLE_WRITE_ERROR);
+    CHECK(verifier->mismatch());
+    
+    boost::weak_ptr<curl_asio::digest_verifier> unbound(verifier);
+    verifier.reset();
+    CHECK(unbound.expired());
+    
+    received = 0;
+    CHECK(trans->start(server.url("/hello")));
+    io.reset();
+    io.run();
+    
+    CHECK(results.size() == 2);
+    CHECK(results.size() == 2 && results.back() == CURLE_OK);
+    CHECK(received == 11);
+    
+    received = 0;
+    verifier = curl_asio::digest_verifier::create(trans, curl_asio::digest_verifier::algorithm::crc32c, "c99465aa");
+    CHECK(trans->start(server.url("/hello")));
+    io.reset();
+    io.run();
+    
+    CHECK(results.size() == 3);
+    CHECK(results.size() == 3 && results.back() == CURLE_OK);
+    CHECK(received == 11);
+    CHECK(verifier->verified());
+    CHECK(!verifier->mismatch());
+    CHECK(verifier->digest() == "c99465aa");
+    return test_result("digest_verifier_test");
+}
@@ -0,0 +1,64 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+static test_server::script hello(const std::string&)
+{
+    return test_server::respond("hello world");
+}
+
+int main()
+{
+    test_watchdog(30);
+    CHECK(curl_asio::global_init::references() == 0);
+    
+    {
+        curl_asio::global_init all;
+        CHECK(all.ok());
+        CHECK(curl_asio::global_init::flags() == CURL_GLOBAL_ALL);
+        
+        curl_asio::global_init same(CURL_GLOBAL_ALL);
+        CHECK(same.ok());
+        
+        curl_asio::global_init other_flags(CURL_GLOBAL_NOTHING);
+        CHECK(!other_flags.ok());
+        
+        curl_asio::global_init other_hooks(curl_asio::pool_allocator::hooks());
+        CHECK(!other_hooks.ok());
+        CHECK(curl_asio::global_init::references() == 2);
+    }
+    CHECK(curl_asio::global_init::references() == 0);
+    
+    {
+        curl_asio::global_init pooled(curl_asio::pool_allocator::hooks());
+        CHECK(pooled.ok());
+        
+        curl_asio::global_init same_hooks(curl_asio::pool_allocator::hooks());
+        CHECK(same_hooks.ok());
+        
+        curl_asio::global_init default_hooks;
+        CHECK(!default_hooks.ok());
+        
+        boost::asio::io_service io;
+        curl_asio curl(io);
+        CHECK(curl_asio::global_init::references() == 3);
+    }
+    CHECK(curl_asio::global_init::references() == 0);
+    
+    test_server server(hello);
+    curl_asio::transfer::ptr trans;
+    {
+        boost::asio::io_service io;
+        curl_asio curl(io);
+        trans = curl.create_transfer();
+        CHECK(curl_asio::global_init::references() == 2);
+        CHECK(trans->start(server.url("/hello")));
+    }
+    CHECK(curl_asio::global_init::references() == 1);
+    CHECK(!trans->start(server.url("/hello")));
+    boost::weak_ptr<curl_asio::transfer> released(trans);
+    trans.reset();
+    CHECK(released.expired());
+    CHECK(curl_asio::global_init::references() == 0);
+    
+    return test_result("global_init_test");
+}
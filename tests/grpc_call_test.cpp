@@ -0,0 +1,304 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+class h2c_server
+{
+public:
+    struct step
+    {
+        long delay_ms;
+        std::string frame;
+    };
+    
+    explicit h2c_server(const std::vector<step>& script)
+        : protocol_error(false),
+          script_(script),
+          acceptor_(io_, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+    {
+        thread_ = boost::thread(boost::bind(&h2c_server::serve, this));
+    }
+    
+    ~h2c_server()
+    {
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        thread_.join();
+    }
+    
+    std::string url(const std::string& path) const
+    {
+        std::ostringstream os;
+        os << "http://127.0.0.1:" << acceptor_.local_endpoint().port() << path;
+        return os.str();
+    }
+    
+    static std::string frame(int type, int flags, unsigned int stream, const std::string& payload)
+    {
+        std::string ret;
+        ret += static_cast<char>(payload.size() >> 16);
+        ret += static_cast<char>(payload.size() >> 8);
+        ret += static_cast<char>(payload.size());
+        ret += static_cast<char>(type);
+        ret += static_cast<char>(flags);
+        ret += static_cast<char>(stream >> 24);
+        ret += static_cast<char>(stream >> 16);
+        ret += static_cast<char>(stream >> 8);
+        ret += static_cast<char>(stream);
+        return ret + payload;
+    }
+    
+    static std::string literal(const std::string& name, const std::string& value)
+    {
+        std::string ret(1, '\0');
+        ret += static_cast<char>(name.size());
+        ret += name;
+        ret += static_cast<char>(value.size());
+        return ret + value;
+    }
+    
+    static std::string grpc_message(const std::string& payload)
+    {
+        std::string ret(1, '\0');
+        ret += static_cast<char>(payload.size() >> 24);
+        ret += static_cast<char>(payload.size() >> 16);
+        ret += static_cast<char>(payload.size() >> 8);
+        ret += static_cast<char>(payload.size());
+        return ret + payload;
+    }
+    
+    enum
+    {
+        type_data = 0,
+        type_headers = 1,
+        type_settings = 4,
+        flag_end_stream = 1,
+        flag_ack = 1,
+        flag_end_headers = 4
+    };
+    
+    std::string request_body;
+    bool protocol_error;
+
+private:
+    std::vector<step> script_;
+    boost::asio::io_service io_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    boost::thread thread_;
+    
+    bool read_frame(boost::asio::ip::tcp::socket& socket, int& type, int& flags, unsigned int& stream, std::string& payload)
+    {
+        unsigned char head[9];
+        boost::system::error_code err;
+        boost::asio::read(socket, boost::asio::buffer(head), err);
+        if (err)
+            return false;
+        
+        std::size_t size = (head[0] << 16) | (head[1] << 8) | head[2];
+        type = head[3];
+        flags = head[4];
+        stream = ((head[5] & 0x7f) << 24) | (head[6] << 16) | (head[7] << 8) | head[8];
+        payload.resize(size);
+        if (size)
+            boost::asio::read(socket, boost::asio::buffer(&payload[0], size), err);
+        
+        if (!err && type == type_settings && !(flags & flag_ack))
+            boost::asio::write(socket, boost::asio::buffer(frame(type_settings, flag_ack, 0, std::string())), err);
+        return !err;
+    }
+    
+    void serve()
+    {
+        try
+        {
+            boost::asio::ip::tcp::socket socket(io_);
+            acceptor_.accept(socket);
+            socket.set_option(boost::asio::ip::tcp::no_delay(true));
+            
+            static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+            std::string received(sizeof(preface) - 1, '\0');
+            boost::asio::read(socket, boost::asio::buffer(&received[0], received.size()));
+            if (received != preface)
+            {
+                protocol_error = true;
+                return;
+            }
+            boost::asio::write(socket, boost::asio::buffer(frame(type_settings, 0, 0, std::string())));
+            
+            int type, flags;
+            unsigned int stream;
+            std::string payload;
+            bool request_done = false;
+            while (!request_done && read_frame(socket, type, flags, stream, payload))
+            {
+                if (type == type_data && stream == 1)
+                    request_body += payload;
+                if ((type == type_data || type == type_headers) && stream == 1 && (flags & flag_end_stream))
+                    request_done = true;
+            }
+            
+            for (std::vector<step>::const_iterator it(script_.begin()); it != script_.end(); ++it)
+            {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(it->delay_ms));
+                boost::asio::write(socket, boost::asio::buffer(it->frame));
+            }
+            
+            while (read_frame(socket, type, flags, stream, payload))
+                ;
+        }
+        catch (const boost::system::system_error&)
+        {
+        }
+    }
+};
+
+static h2c_server::step at(long delay_ms, const std::string& frame)
+{
+    h2c_server::step ret;
+    ret.delay_ms = delay_ms;
+    ret.frame = frame;
+    return ret;
+}
+
+static std::string response_headers()
+{
+    std::string block;
+    block += static_cast<char>(0x88);
+    block += h2c_server::literal("content-type", "application/grpc");
+    return h2c_server::frame(h2c_server::type_headers, h2c_server::flag_end_headers, 1, block);
+}
+
+static std::string trailers(int status, const std::string& message)
+{
+    std::ostringstream os;
+    os << status;
+    std::string block(h2c_server::literal("grpc-status", os.str()));
+    if (!message.empty())
+        block += h2c_server::literal("grpc-message", message);
+    return h2c_server::frame(h2c_server::type_headers, h2c_server::flag_end_headers | h2c_server::flag_end_stream, 1, block);
+}
+
+static std::string data(const std::string& payload)
+{
+    return h2c_server::frame(h2c_server::type_data, 0, 1, payload);
+}
+
+struct call_result
+{
+    std::vector<std::string> messages;
+    int status;
+    std::string status_message;
+    CURLcode result;
+    bool write_ok;
+    
+    call_result()
+        : status(-100),
+          result(CURL_LAST),
+          write_ok(false)
+    {
+    }
+};
+
+static curl_asio::data_action::type on_message(call_result *r, const boost::asio::const_buffer& buffer)
+{
+    r->messages.push_back(std::string(boost::asio::buffer_cast<const char*>(buffer), boost::asio::buffer_size(buffer)));
+    return curl_asio::data_action::success;
+}
+
+static void on_done(call_result *r, int status, const std::string& message, CURLcode result)
+{
+    r->status = status;
+    r->status_message = message;
+    r->result = result;
+}
+
+static void on_written(call_result *r, curl_asio::grpc_call::ptr call, const boost::system::error_code& err)
+{
+    r->write_ok = !err;
+    call->writes_done();
+}
+
+static call_result run_call(h2c_server& server, const std::string& request)
+{
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    call_result r;
+    
+    curl_asio::grpc_call::ptr call(curl_asio::grpc_call::create(curl.create_transfer()));
+    CHECK(call);
+    call->on_message = boost::bind(on_message, &r, _1);
+    call->on_done = boost::bind(on_done, &r, _1, _2, _3);
+    CHECK(call->start(server.url("/test.Echo/Call")));
+    call->async_write(boost::asio::buffer(request), boost::bind(on_written, &r, call, _1));
+    io.run();
+    return r;
+}
+
+static bool http2_supported()
+{
+    curl_version_info_data *info = ::curl_version_info(CURLVERSION_NOW);
+    return (info->features & CURL_VERSION_HTTP2) != 0;
+}
+
+int main()
+{
+    if (!http2_supported())
+    {
+        std::cout << "grpc_call_test: skipped, libcurl has no HTTP/2 support" << std::endl;
+        return 0;
+    }
+    
+    test_watchdog(30);
+    
+    {
+        std::string first(h2c_server::grpc_message("split across two chunks"));
+        std::string second(h2c_server::grpc_message("second"));
+        std::vector<h2c_server::step> script;
+        script.push_back(at(0, response_headers()));
+        script.push_back(at(0, data(first.substr(0, 3))));
+        script.push_back(at(100, data(first.substr(3, 10))));
+        script.push_back(at(100, data(first.substr(13) + second.substr(0, 8))));
+        script.push_back(at(100, data(second.substr(8))));
+        script.push_back(at(0, trailers(5, "no such entity")));
+        h2c_server server(script);
+        
+        call_result r(run_call(server, "request"));
+        CHECK(!server.protocol_error);
+        CHECK(server.request_body == h2c_server::grpc_message("request"));
+        CHECK(r.write_ok);
+        CHECK(r.messages.size() == 2);
+        CHECK(r.messages.size() == 2 && r.messages[0] == "split across two chunks");
+        CHECK(r.messages.size() == 2 && r.messages[1] == "second");
+        CHECK(r.result == CURLE_OK);
+        CHECK(r.status == 5);
+        CHECK(r.status_message == "no such entity");
+    }
+    
+    {
+        std::vector<h2c_server::step> script;
+        script.push_back(at(0, response_headers()));
+        script.push_back(at(0, data(h2c_server::grpc_message(std::string()))));
+        script.push_back(at(0, trailers(curl_asio::grpc_call::status_ok, std::string())));
+        h2c_server server(script);
+        
+        call_result r(run_call(server, std::string()));
+        CHECK(server.request_body == h2c_server::grpc_message(std::string()));
+        CHECK(r.messages.size() == 1 && r.messages[0].empty());
+        CHECK(r.result == CURLE_OK);
+        CHECK(r.status == curl_asio::grpc_call::status_ok);
+        CHECK(r.status_message.empty());
+    }
+    
+    {
+        std::vector<h2c_server::step> script;
+        script.push_back(at(0, response_headers()));
+        script.push_back(at(0, h2c_server::frame(h2c_server::type_data, h2c_server::flag_end_stream, 1, std::string())));
+        h2c_server server(script);
+        
+        call_result r(run_call(server, "request"));
+        CHECK(r.messages.empty());
+        CHECK(r.result == CURLE_OK);
+        CHECK(r.status == curl_asio::grpc_call::status_unknown);
+    }
+    
+    return test_result("grpc_call_test");
+}
@@ -0,0 +1,195 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+#include <fstream>
+#include <iomanip>
+
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+enum
+{
+    default_transfers = 1000
+};
+
+static const long connect_timeout_ms = 30000;
+static const long poll_interval_ms = 50;
+
+static test_server::script hold(const std::string&)
+{
+    return test_server::script(1, test_server::step(600000, std::string()));
+}
+
+struct usage
+{
+    double heap;
+    double resident;
+};
+
+static usage current_usage()
+{
+    usage ret;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = ::mallinfo2();
+#else
+    struct mallinfo mi = ::mallinfo();
+#endif
+    ret.heap = static_cast<double>(mi.uordblks) + static_cast<double>(mi.hblkhd);
+    
+    std::ifstream statm("/proc/self/statm");
+    long size = 0, resident = 0;
+    statm >> size >> resident;
+    ret.resident = static_cast<double>(resident) * ::sysconf(_SC_PAGESIZE);
+    return ret;
+}
+
+static curl_asio::data_action::type discard(const boost::asio::const_buffer&)
+{
+    return curl_asio::data_action::success;
+}
+
+struct waiter
+{
+    boost::asio::io_service *io;
+    boost::asio::deadline_timer *timer;
+    const std::vector<curl_asio::transfer::ptr> *transfers;
+    long waited_ms;
+    bool connected;
+};
+
+static void check_connected(waiter *w, const boost::system::error_code& err)
+{
+    if (err)
+        return;
+    
+    std::size_t sent = 0;
+    for (std::size_t i = 0; i < w->transfers->size(); ++i)
+    {
+        if ((*w->transfers)[i]->info().pretransfer_time() > 0)
+            ++sent;
+    }
+    
+    w->waited_ms += poll_interval_ms;
+    if (sent == w->transfers->size() || w->waited_ms >= connect_timeout_ms)
+    {
+        w->connected = sent == w->transfers->size();
+        w->io->stop();
+        return;
+    }
+    
+    w->timer->expires_from_now(boost::posix_time::milliseconds(poll_interval_ms));
+    w->timer->async_wait(boost::bind(check_connected, w, _1));
+}
+
+struct variant
+{
+    const char *name;
+    bool shared;
+    curl_asio::buffer_sizing::type buffers;
+};
+
+static int measure(const variant& v, const std::string& url, int count)
+{
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    boost::shared_ptr<curl_asio::transfer::options> profile(boost::make_shared<curl_asio::transfer::options>());
+    profile->buffer_profile = v.buffers;
+    std::vector<curl_asio::transfer::ptr> transfers;
+    transfers.reserve(count);
+    
+    usage empty(current_usage());
+    for (int i = 0; i < count; ++i)
+    {
+        curl_asio::transfer::ptr trans;
+        if (v.shared)
+        {
+            trans = curl.create_transfer(profile);
+        }
+        else
+        {
+            trans = curl.create_transfer();
+            if (trans)
+                trans->opt.buffer_profile = v.buffers;
+        }
+        if (!trans)
+            return 1;
+        trans->on_data_read = discard;
+        transfers.push_back(trans);
+    }
+    usage created(current_usage());
+    
+    for (int i = 0; i < count; ++i)
+    {
+        if (!transfers[i]->start(url))
+            return 1;
+    }
+    
+    boost::asio::deadline_timer timer(io);
+    waiter w = { &io, &timer, &transfers, 0, false };
+    timer.expires_from_now(boost::posix_time::milliseconds(poll_interval_ms));
+    timer.async_wait(boost::bind(check_connected, &w, _1));
+    io.run();
+    if (!w.connected)
+        return 1;
+    usage connected(current_usage());
+    
+    std::cout << std::setw(16) << v.name << std::fixed << std::setprecision(0)
+              << "  idle transfer" << std::setw(7) << (created.heap - empty.heap) / count << " B heap" << std::setw(7) << (created.resident - empty.resident) / count << " B resident"
+              << "  idle socket" << std::setw(7) << (connected.heap - created.heap) / count << " B heap" << std::setw(7) << (connected.resident - created.resident) / count << " B resident" << std::endl;
+    return 0;
+}
+
+static bool run_forked(const variant& v, const std::string& url, int count)
+{
+    std::cout.flush();
+    pid_t pid = ::fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0)
+    {
+        int rc = measure(v, url, count);
+        std::cout.flush();
+        ::_exit(rc);
+    }
+    
+    int status = 0;
+    return ::waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? std::atoi(argv[1]) : default_transfers;
+    if (count <= 0)
+    {
+        std::cerr << "usage: idle_memory_bench [transfers]" << std::endl;
+        return 1;
+    }
+    
+    struct rlimit files;
+    if (::getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max)
+    {
+        files.rlim_cur = files.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &files);
+    }
+    
+    static const variant variants[] = {
+        { "owned", false, curl_asio::buffer_sizing::standard },
+        { "profile", true, curl_asio::buffer_sizing::standard },
+        { "owned low_mem", false, curl_asio::buffer_sizing::low_memory },
+        { "profile low_mem", true, curl_asio::buffer_sizing::low_memory }
+    };
+    
+    test_server server(hold);
+    std::cout << "idle_memory_bench: " << count << " long-polls per variant, sizeof(owned_transfer) " << sizeof(curl_asio::owned_transfer)
+              << ", sizeof(shared_transfer) " << sizeof(curl_asio::shared_transfer) << "; an idle transfer is created but not started, an idle socket has sent its request and waits for a response" << std::endl;
+    for (std::size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i)
+    {
+        if (!run_forked(variants[i], server.url("/poll"), count))
+        {
+            std::cerr << "idle_memory_bench: " << variants[i].name << " failed" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+#include <algorithm>
+#include <iomanip>
+
+#include <time.h>
+
+enum
+{
+    warmup_requests = 200,
+    requests = 2000
+};
+
+static double now_us()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+struct client
+{
+    curl_asio *curl;
+    curl_asio::transfer::ptr trans;
+    std::string url;
+    int remaining;
+    double started;
+    std::vector<double> latencies;
+    bool failed;
+};
+
+static curl_asio::data_action::type discard(const boost::asio::const_buffer&)
+{
+    return curl_asio::data_action::success;
+}
+
+static void start(client *c);
+
+static void on_done(client *c, CURLcode result)
+{
+    if (result != CURLE_OK)
+    {
+        c->failed = true;
+        return;
+    }
+    
+    c->latencies.push_back(now_us() - c->started);
+    if (--c->remaining > 0)
+        c->curl->get_strand().post(boost::bind(start, c));
+}
+
+static void start(client *c)
+{
+    c->started = now_us();
+    if (!c->trans->start(c->url))
+        c->failed = true;
+}
+
+static bool measure(const std::string& url, bool busy, long busy_poll_us, std::vector<double>& latencies)
+{
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    client c;
+    c.curl = &curl;
+    c.trans = curl.create_transfer();
+    c.trans->opt.busy_poll_us = busy_poll_us;
+    c.trans->on_data_read = discard;
+    c.trans->on_done = boost::bind(on_done, &c, _1);
+    c.url = url;
+    c.remaining = warmup_requests + requests;
+    c.failed = false;
+    
+    curl.get_strand().post(boost::bind(start, &c));
+    if (busy)
+        curl_asio::run_busy(io);
+    else
+        io.run();
+    
+    if (c.failed || c.latencies.size() != warmup_requests + requests)
+        return false;
+    latencies.assign(c.latencies.begin() + warmup_requests, c.latencies.end());
+    std::sort(latencies.begin(), latencies.end());
+    return true;
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(p * sorted.size()))];
+}
+
+int main()
+{
+    keep_alive_server server;
+    
+    struct variant
+    {
+        const char *name;
+        bool busy;
+        long busy_poll_us;
+    };
+    static const variant variants[] = {
+        { "run", false, 0 },
+        { "run_busy", true, 0 },
+        { "busy_poll", true, 50 }
+    };
+    
+    std::cout << "latency_bench: " << requests << " sequential keep-alive requests on loopback after " << warmup_requests << " warm-up requests" << std::endl;
+    for (std::size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i)
+    {
+        std::vector<double> latencies;
+        if (!measure(server.url("/ping"), variants[i].busy, variants[i].busy_poll_us, latencies))
+        {
+            std::cerr << "latency_bench: " << variants[i].name << " failed" << std::endl;
+            return 1;
+        }
+        std::cout << std::setw(12) << variants[i].name << std::fixed << std::setprecision(1)
+                  << "  p50" << std::setw(9) << percentile(latencies, 0.50) << " us"
+                  << "  p99" << std::setw(9) << percentile(latencies, 0.99) << " us"
+                  << "  max" << std::setw(9) << latencies.back() << " us" << std::endl;
+    }
+    return 0;
+}
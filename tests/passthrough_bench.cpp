@@ -0,0 +1,127 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+#include <iomanip>
+
+#include <sys/resource.h>
+#include <zlib.h>
+
+enum
+{
+    body_size = 32 * 1024 * 1024,
+    runs = 5
+};
+
+static std::string make_body()
+{
+    static const char *paths[] = { "/api/v1/items", "/api/v1/users", "/static/app.js", "/healthz" };
+    
+    std::string body;
+    body.reserve(body_size + 256);
+    unsigned long seed = 12345;
+    while (body.size() < body_size)
+    {
+        seed = seed * 1103515245ul + 12345ul;
+        std::ostringstream line;
+        line << "{\"path\":\"" << paths[(seed >> 12) & 3] << "\",\"status\":" << 200 + ((seed >> 16) % 5) * 100
+             << ",\"bytes\":" << (seed >> 4) % 100000 << ",\"req\":\"" << std::hex << seed << "\"}\n";
+        body += line.str();
+    }
+    body.resize(body_size);
+    return body;
+}
+
+static std::string gzip(const std::string& data)
+{
+    z_stream z;
+    std::memset(&z, 0, sizeof(z));
+    ::deflateInit2(&z, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    std::string out(::deflateBound(&z, data.size()), '\0');
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    z.avail_in = static_cast<uInt>(data.size());
+    z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    z.avail_out = static_cast<uInt>(out.size());
+    ::deflate(&z, Z_FINISH);
+    out.resize(z.total_out);
+    ::deflateEnd(&z);
+    return out;
+}
+
+static std::string response;
+
+static test_server::script serve(const std::string&)
+{
+    return test_server::script(1, test_server::step(0, response));
+}
+
+static double thread_cpu_seconds()
+{
+    struct rusage usage;
+    ::getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static curl_asio::data_action::type count(curl_off_t *received, const boost::asio::const_buffer& buffer)
+{
+    *received += boost::asio::buffer_size(buffer);
+    return curl_asio::data_action::success;
+}
+
+struct result
+{
+    double cpu;
+    curl_off_t received;
+    std::string encoding;
+};
+
+static bool fetch(const std::string& url, bool passthrough, result& r)
+{
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    curl_asio::transfer::ptr trans(curl.create_transfer());
+    trans->opt.accept_encoding = "gzip";
+    trans->opt.raw_passthrough = passthrough;
+    
+    r.cpu = 0;
+    for (int run = 0; run < runs; ++run)
+    {
+        r.received = 0;
+        trans->on_data_read = boost::bind(count, &r.received, _1);
+        double cpu = thread_cpu_seconds();
+        if (!trans->start(url))
+            return false;
+        io.run();
+        io.reset();
+        r.cpu += thread_cpu_seconds() - cpu;
+    }
+    r.cpu /= runs;
+    r.encoding = trans->content_encoding();
+    return true;
+}
+
+int main()
+{
+    std::string body(make_body());
+    std::string compressed(gzip(body));
+    std::ostringstream os;
+    os << "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: " << compressed.size() << "\r\nConnection: close\r\n\r\n" << compressed;
+    response = os.str();
+    test_server server(serve);
+    
+    result decoded, raw;
+    if (!fetch(server.url("/logs"), false, decoded) || !fetch(server.url("/logs"), true, raw))
+    {
+        std::cerr << "passthrough_bench: transfer failed" << std::endl;
+        return 1;
+    }
+    if (decoded.received != static_cast<curl_off_t>(body.size()) || raw.received != static_cast<curl_off_t>(compressed.size()))
+    {
+        std::cerr << "passthrough_bench: unexpected body sizes " << decoded.received << " and " << raw.received << std::endl;
+        return 1;
+    }
+    
+    std::cout << "passthrough_bench: " << body_size / (1024 * 1024) << " MB body served gzip-compressed to " << std::fixed << std::setprecision(1) << compressed.size() / (1024.0 * 1024) << " MB, client thread CPU per download (average of " << runs << ")" << std::endl;
+    std::cout << std::setw(12) << "decoded" << std::setw(10) << decoded.cpu * 1e3 << " ms CPU, " << decoded.received << " bytes delivered" << std::endl
+              << std::setw(12) << "passthrough" << std::setw(10) << raw.cpu * 1e3 << " ms CPU, " << raw.received << " bytes delivered, content_encoding() \"" << raw.encoding << "\"" << std::endl;
+    return 0;
+}
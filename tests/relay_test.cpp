@@ -0,0 +1,56 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+static test_server::script big_body(const std::string&)
+{
+    return test_server::respond(std::string(16 * 1024 * 1024, 'x'));
+}
+
+static bool done = false;
+static CURLcode done_result = CURLE_OK;
+static boost::system::error_code done_error;
+
+static void on_relay_done(CURLcode result, const boost::system::error_code& err)
+{
+    done = true;
+    done_result = result;
+    done_error = err;
+}
+
+static void reset_peer(boost::asio::ip::tcp::socket *peer)
+{
+    peer->set_option(boost::asio::socket_base::linger(true, 0));
+    peer->close();
+}
+
+int main()
+{
+    test_watchdog(30);
+    test_server server(big_body);
+    
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    
+    boost::asio::ip::tcp::acceptor acceptor(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    boost::asio::ip::tcp::socket downstream(io);
+    boost::asio::ip::tcp::socket peer(io);
+    downstream.connect(acceptor.local_endpoint());
+    acceptor.accept(peer);
+    acceptor.close();
+    
+    curl_asio::transfer::ptr trans(curl.create_transfer());
+    curl_asio::relay<boost::asio::ip::tcp::socket>::ptr r(curl_asio::relay<boost::asio::ip::tcp::socket>::create(trans, downstream, 256 * 1024));
+    r->on_done = on_relay_done;
+    CHECK(trans->start(server.url("/big")));
+    
+    boost::asio::deadline_timer timer(io);
+    timer.expires_from_now(boost::posix_time::milliseconds(200));
+    timer.async_wait(boost::bind(reset_peer, &peer));
+    
+    io.run();
+    
+    CHECK(done);
+    CHECK(done_error);
+    CHECK(done_result != CURLE_OK);
+    return test_result("relay_test");
+}
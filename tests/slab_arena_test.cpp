@@ -0,0 +1,183 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+static test_server::script body(const std::string& path)
+{
+    if (path == "/huge")
+        return test_server::script(1, test_server::step(0, "HTTP/1.1 200 OK\r\nContent-Length: 1073741824\r\nConnection: close\r\n\r\n" + std::string(100, 'x')));
+    if (path == "/split")
+    {
+        test_server::script chunks;
+        chunks.push_back(test_server::step(0, test_server::chunk(std::string(1000, 'a'))));
+        chunks.push_back(test_server::step(300, test_server::chunk(std::string(3000, 'b'))));
+        return test_server::respond_chunked(chunks);
+    }
+    return test_server::respond(std::string(path == "/first" ? 1000 : 3000, 'x'));
+}
+
+static int collected = 0;
+static curl_asio::slab_arena::view first;
+static std::size_t huge_reserved = 0;
+static int restarted = 0;
+
+struct split_result
+{
+    curl_asio::slab_arena::view view;
+    std::string body;
+    int calls;
+};
+
+static const std::string split_body(std::string(1000, 'a') + std::string(3000, 'b'));
+
+static void on_split(split_result *r, CURLcode result, const curl_asio::slab_arena::view& body)
+{
+    ++r->calls;
+    CHECK(result == CURLE_OK);
+    r->view = body;
+    r->body = body.str();
+}
+
+static curl_asio::slab_arena::view interleaved;
+
+static void interleave(curl_asio::slab_arena::ptr arena, const boost::system::error_code& err)
+{
+    CHECK(!err);
+    interleaved = arena->store("y", 1);
+}
+
+static std::size_t used_after_release = 0;
+static std::size_t slabs_after_release = 0;
+
+static void release_in_flight(curl_asio::slab_arena::ptr arena, const boost::system::error_code& err)
+{
+    CHECK(!err);
+    arena->release();
+    used_after_release = arena->used();
+    slabs_after_release = arena->slabs();
+    arena->store(std::string(100, 'z').data(), 100);
+}
+
+static void on_huge(curl_asio::slab_arena::ptr arena, CURLcode, const curl_asio::slab_arena::view&)
+{
+    huge_reserved = arena->reserved();
+}
+
+static void on_restarted(CURLcode)
+{
+    ++restarted;
+}
+
+static void restart(curl_asio::transfer *trans, const std::string& url)
+{
+    trans->on_done = on_restarted;
+    CHECK(trans->start(url));
+}
+
+static void on_collected(boost::asio::io_service *io, curl_asio::transfer *trans, const std::string& url, CURLcode result, const curl_asio::slab_arena::view& body)
+{
+    ++collected;
+    first = body;
+    CHECK(result == CURLE_OK);
+    io->post(boost::bind(restart, trans, url));
+}
+
+int main()
+{
+    test_watchdog(30);
+    test_server server(body);
+    
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    curl_asio::slab_arena::ptr arena(curl_asio::slab_arena::create(64 * 1024, 1024 * 1024));
+    
+    curl_asio::transfer::ptr trans(curl.create_transfer());
+    arena->collect(trans, boost::bind(on_collected, &io, trans.get(), server.url("/second"), _1, _2));
+    CHECK(trans->start(server.url("/first")));
+    
+    curl_asio::transfer::ptr huge(curl.create_transfer());
+    arena->collect(huge, boost::bind(on_huge, arena, _1, _2));
+    CHECK(huge->start(server.url("/huge")));
+    
+    io.run();
+    
+    CHECK(collected == 1);
+    CHECK(restarted == 1);
+    CHECK(first.size == 1000);
+    CHECK(first.str() == std::string(1000, 'x'));
+    CHECK(reinterpret_cast<std::size_t>(first.data) % 16 == 0);
+    CHECK(huge_reserved > 0);
+    CHECK(huge_reserved <= 2 * 1024 * 1024);
+    
+    for (std::size_t size = 1; size < 64; ++size)
+        CHECK(reinterpret_cast<std::size_t>(arena->store(first.data, size).data) % 16 == 0);
+    
+    curl_asio::slab_arena::ptr tail(curl_asio::slab_arena::create(64 * 1024));
+    curl_asio::slab_arena::view base(tail->store("x", 1));
+    split_result extended = split_result();
+    curl_asio::transfer::ptr extending(curl.create_transfer());
+    tail->collect(extending, boost::bind(on_split, &extended, _1, _2));
+    CHECK(extending->start(server.url("/split")));
+    
+    curl_asio::slab_arena::ptr moved(curl_asio::slab_arena::create(64 * 1024));
+    curl_asio::slab_arena::view moved_base(moved->store("x", 1));
+    split_result relocated = split_result();
+    curl_asio::transfer::ptr relocating(curl.create_transfer());
+    moved->collect(relocating, boost::bind(on_split, &relocated, _1, _2));
+    CHECK(relocating->start(server.url("/split")));
+    boost::asio::deadline_timer interleave_timer(io, boost::posix_time::milliseconds(150));
+    interleave_timer.async_wait(boost::bind(interleave, moved, _1));
+    
+    curl_asio::slab_arena::ptr pinned(curl_asio::slab_arena::create(64 * 1024));
+    split_result survived = split_result();
+    curl_asio::transfer::ptr pinning(curl.create_transfer());
+    pinned->collect(pinning, boost::bind(on_split, &survived, _1, _2));
+    CHECK(pinning->start(server.url("/split")));
+    boost::asio::deadline_timer release_timer(io, boost::posix_time::milliseconds(150));
+    release_timer.async_wait(boost::bind(release_in_flight, pinned, _1));
+    
+    io.reset();
+    io.run();
+    
+    CHECK(extended.calls == 1);
+    CHECK(extended.body == split_body);
+    CHECK(extended.view.data == base.data + 16);
+    CHECK(tail->slabs() == 1);
+    CHECK(tail->used() == 16 + split_body.size());
+    
+    CHECK(relocated.calls == 1);
+    CHECK(relocated.body == split_body);
+    CHECK(interleaved.data == moved_base.data + 16 + 1008);
+    CHECK(relocated.view.data > interleaved.data);
+    
+    CHECK(survived.calls == 1);
+    CHECK(survived.body == split_body);
+    CHECK(used_after_release >= 1000);
+    CHECK(slabs_after_release == 1);
+    pinned->release();
+    CHECK(pinned->used() == 0);
+    CHECK(pinned->slabs() == 1);
+    CHECK(pinned->reserved() == 64 * 1024);
+    
+    curl_asio::slab_arena::ptr recycled(curl_asio::slab_arena::create(64 * 1024));
+    std::string small(4000, 's');
+    for (int i = 0; i < 20; ++i)
+        recycled->store(small.data(), small.size());
+    CHECK(recycled->slabs() == 2);
+    CHECK(recycled->reserved() == 2 * 64 * 1024);
+    
+    std::string large(32 * 1024, 'l');
+    recycled->store(large.data(), large.size());
+    CHECK(recycled->slabs() == 3);
+    CHECK(recycled->reserved() == 2 * 64 * 1024 + large.size());
+    
+    recycled->release();
+    CHECK(recycled->used() == 0);
+    CHECK(recycled->slabs() == 2);
+    CHECK(recycled->reserved() == 2 * 64 * 1024);
+    
+    for (int i = 0; i < 20; ++i)
+        recycled->store(small.data(), small.size());
+    CHECK(recycled->slabs() == 2);
+    CHECK(recycled->reserved() == 2 * 64 * 1024);
+    return test_result("slab_arena_test");
+}
@@ -0,0 +1,114 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+#include <boost/atomic.hpp>
+
+enum
+{
+    threads = 16,
+    jobs = 64,
+    transfers_per_job = 20,
+    body_size = 100000
+};
+
+static test_server::script body(const std::string&)
+{
+    return test_server::respond(std::string(body_size, 'x'));
+}
+
+struct job
+{
+    curl_asio *curl;
+    std::string url;
+    int remaining;
+    
+    job()
+        : curl(NULL),
+          remaining(transfers_per_job)
+    {
+    }
+};
+
+static boost::atomic<int> completed(0);
+static boost::atomic<int> failed(0);
+static boost::atomic<int> in_handler(0);
+static boost::atomic<int> overlapping(0);
+
+static void enter_handler()
+{
+    if (in_handler.fetch_add(1) != 0)
+        ++overlapping;
+    boost::this_thread::yield();
+}
+
+static void leave_handler()
+{
+    in_handler.fetch_sub(1);
+}
+
+static void start(job *j);
+
+static curl_asio::data_action::type on_data(job *j, curl_asio::transfer *trans, std::size_t *received, const boost::asio::const_buffer& buffer)
+{
+    enter_handler();
+    *received += boost::asio::buffer_size(buffer);
+    if (std::rand() % 17 == 0 && trans->pause(CURLPAUSE_RECV))
+        trans->resume(CURLPAUSE_RECV);
+    
+    leave_handler();
+    return curl_asio::data_action::success;
+}
+
+static void on_done(job *j, std::size_t *received, CURLcode result)
+{
+    enter_handler();
+    if (result == CURLE_OK && *received == body_size)
+        ++completed;
+    else
+        ++failed;
+    
+    delete received;
+    leave_handler();
+    if (--j->remaining > 0)
+        start(j);
+}
+
+static void start(job *j)
+{
+    curl_asio::transfer::ptr trans(j->curl->create_transfer());
+    std::size_t *received = new std::size_t(0);
+    trans->on_data_read = boost::bind(on_data, j, trans.get(), received, _1);
+    trans->on_done = boost::bind(on_done, j, received, _1);
+    if (!trans->start(j->url))
+    {
+        ++failed;
+        delete received;
+    }
+}
+
+int main()
+{
+    test_watchdog(120);
+    test_server server(body);
+    
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    
+    std::vector<job> all(jobs);
+    for (std::size_t i = 0; i < all.size(); ++i)
+    {
+        all[i].curl = &curl;
+        all[i].url = server.url("/body");
+        curl.get_strand().post(boost::bind(start, &all[i]));
+    }
+    
+    boost::thread_group pool;
+    for (int i = 0; i < threads; ++i)
+        pool.create_thread(boost::bind(&boost::asio::io_service::run, &io));
+    pool.join_all();
+    
+    CHECK(overlapping == 0);
+    CHECK(failed == 0);
+    CHECK(completed == jobs * transfers_per_job);
+    return test_result("strand_stress_test");
+}
@@ -0,0 +1,261 @@
+#ifndef CURL_ASIO_TEST_SERVER__HPP
+#define CURL_ASIO_TEST_SERVER__HPP
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+
+#include <unistd.h>
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::cerr << __FILE__ ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; ++test_failures(); } } while (0)
+
+inline int& test_failures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+inline int test_result(const char *name)
+{
+    std::cout << name << ": " << (test_failures() ? "FAILED" : "passed") << std::endl;
+    return test_failures() ? 1 : 0;
+}
+
+inline void test_watchdog_thread(long seconds)
+{
+    boost::this_thread::sleep(boost::posix_time::seconds(seconds));
+    std::cerr << "test timed out after " << seconds << "s" << std::endl;
+    ::_exit(2);
+}
+
+inline void test_watchdog(long seconds)
+{
+    boost::thread(boost::bind(test_watchdog_thread, seconds)).detach();
+}
+
+class test_server
+{
+public:
+    struct step
+    {
+        long delay_ms;
+        std::string data;
+        
+        step(long d, const std::string &s)
+            : delay_ms(d),
+              data(s)
+        {
+        }
+    };
+    
+    typedef std::vector<step> script;
+    typedef boost::function<script(const std::string&)> handler;
+    
+    explicit test_server(const handler& h)
+        : acceptor_(io_, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          handler_(h)
+    {
+        accept();
+        thread_ = boost::thread(boost::bind(&boost::asio::io_service::run, &io_));
+    }
+    
+    ~test_server()
+    {
+        io_.stop();
+        thread_.join();
+    }
+    
+    std::string url(const std::string &path) const
+    {
+        std::ostringstream os;
+        os << "http://127.0.0.1:" << acceptor_.local_endpoint().port() << path;
+        return os.str();
+    }
+    
+    static script respond(const std::string &body)
+    {
+        return respond(script(1, step(0, body)));
+    }
+    
+    static script respond(script chunks)
+    {
+        std::size_t length = 0;
+        for (script::const_iterator it(chunks.begin()); it != chunks.end(); ++it)
+            length += it->data.size();
+        
+        std::ostringstream os;
+        os << "HTTP/1.1 200 OK\r\nContent-Length: " << length << "\r\nConnection: close\r\n\r\n";
+        if (chunks.empty())
+            chunks.push_back(step(0, std::string()));
+        chunks.front().data.insert(0, os.str());
+        return chunks;
+    }
+    
+    static script respond_chunked(script chunks)
+    {
+        if (chunks.empty())
+            chunks.push_back(step(0, std::string()));
+        chunks.front().data.insert(0, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n");
+        chunks.back().data.append("0\r\n\r\n");
+        return chunks;
+    }
+    
+    static std::string chunk(const std::string &data)
+    {
+        std::ostringstream os;
+        os << std::hex << data.size() << "\r\n" << data << "\r\n";
+        return os.str();
+    }
+
+private:
+    class session
+    {
+    public:
+        typedef boost::shared_ptr<session> ptr;
+        
+        explicit session(boost::asio::io_service& io)
+            : socket(io),
+              timer(io),
+              next(0)
+        {
+        }
+        
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::deadline_timer timer;
+        boost::asio::streambuf request;
+        script steps;
+        std::size_t next;
+    };
+    
+    boost::asio::io_service io_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    handler handler_;
+    boost::thread thread_;
+    
+    void accept()
+    {
+        session::ptr s(new session(io_));
+        acceptor_.async_accept(s->socket, boost::bind(&test_server::accepted, this, s, boost::asio::placeholders::error));
+    }
+    
+    void accepted(session::ptr s, const boost::system::error_code& err)
+    {
+        if (err)
+            return;
+        
+        boost::asio::async_read_until(s->socket, s->request, "\r\n\r\n", boost::bind(&test_server::read_request, this, s, boost::asio::placeholders::error));
+        accept();
+    }
+    
+    void read_request(session::ptr s, const boost::system::error_code& err)
+    {
+        if (err)
+            return;
+        
+        std::istream is(&s->request);
+        std::string method, path;
+        is >> method >> path;
+        s->steps = handler_(path);
+        run_step(s, boost::system::error_code());
+    }
+    
+    void run_step(session::ptr s, const boost::system::error_code& err)
+    {
+        if (err || s->next == s->steps.size())
+        {
+            boost::system::error_code ignored;
+            s->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+            return;
+        }
+        
+        s->timer.expires_from_now(boost::posix_time::milliseconds(s->steps[s->next].delay_ms));
+        s->timer.async_wait(boost::bind(&test_server::write_step, this, s, boost::asio::placeholders::error));
+    }
+    
+    void write_step(session::ptr s, const boost::system::error_code& err)
+    {
+        if (err)
+            return;
+        
+        const std::string& data(s->steps[s->next++].data);
+        boost::asio::async_write(s->socket, boost::asio::buffer(data), boost::bind(&test_server::run_step, this, s, boost::asio::placeholders::error));
+    }
+};
+
+class keep_alive_server
+{
+public:
+    keep_alive_server()
+        : stopping_(false),
+          acceptor_(io_, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+    {
+        thread_ = boost::thread(boost::bind(&keep_alive_server::serve, this));
+    }
+    
+    ~keep_alive_server()
+    {
+        stopping_ = true;
+        boost::asio::ip::tcp::socket wake(io_);
+        boost::system::error_code ignored;
+        wake.connect(acceptor_.local_endpoint(), ignored);
+        thread_.join();
+    }
+    
+    std::string url(const std::string &path) const
+    {
+        std::ostringstream os;
+        os << "http://127.0.0.1:" << acceptor_.local_endpoint().port() << path;
+        return os.str();
+    }
+
+private:
+    boost::atomic<bool> stopping_;
+    boost::asio::io_service io_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    boost::thread_group connections_;
+    boost::thread thread_;
+    
+    void serve()
+    {
+        for (;;)
+        {
+            boost::shared_ptr<boost::asio::ip::tcp::socket> socket(new boost::asio::ip::tcp::socket(io_));
+            boost::system::error_code err;
+            acceptor_.accept(*socket, err);
+            if (err || stopping_)
+                break;
+            socket->set_option(boost::asio::ip::tcp::no_delay(true), err);
+            connections_.create_thread(boost::bind(&keep_alive_server::serve_connection, socket));
+        }
+        connections_.join_all();
+    }
+    
+    static void serve_connection(boost::shared_ptr<boost::asio::ip::tcp::socket> socket)
+    {
+        static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\npong";
+        boost::asio::streambuf request;
+        boost::system::error_code err;
+        for (;;)
+        {
+            std::size_t n = boost::asio::read_until(*socket, request, "\r\n\r\n", err);
+            if (err)
+                break;
+            request.consume(n);
+            boost::asio::write(*socket, boost::asio::buffer(response, sizeof(response) - 1), err);
+            if (err)
+                break;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,77 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+#include "ws_echo_server.hpp"
+
+#include <iomanip>
+
+#if defined(CURLWS_TEXT) && LIBCURL_VERSION_NUM >= 0x075600
+
+enum
+{
+    round_trips = 2000,
+    bulk_messages = 64,
+    bulk_message_size = 1024 * 1024
+};
+
+static double echo_seconds(const std::vector<std::string>& messages, bool& ok)
+{
+    ws_echo_server server;
+    server.start();
+    
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    ws_echo_client c;
+    c.outgoing = messages;
+    c.ws = curl_asio::websocket::create(curl.create_transfer());
+    
+    boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+    ok = c.ws->async_connect(server.url(), boost::bind(on_connected, &c, _1));
+    io.run();
+    boost::posix_time::time_duration elapsed(boost::posix_time::microsec_clock::universal_time() - start);
+    
+    ok = ok && c.error == CURLE_OK && c.received == messages;
+    c.ws.reset();
+    return elapsed.total_microseconds() / 1e6;
+}
+
+int main()
+{
+    if (!websocket_supported())
+    {
+        std::cout << "websocket_bench: skipped, libcurl has no WebSocket support" << std::endl;
+        return 0;
+    }
+    
+    bool ok = false;
+    std::vector<std::string> small(round_trips, std::string(32, 'p'));
+    double small_seconds = echo_seconds(small, ok);
+    if (!ok)
+    {
+        std::cerr << "websocket_bench: echo of small messages failed" << std::endl;
+        return 1;
+    }
+    
+    std::vector<std::string> bulk(bulk_messages, std::string(bulk_message_size, 'b'));
+    double bulk_seconds = echo_seconds(bulk, ok);
+    if (!ok)
+    {
+        std::cerr << "websocket_bench: echo of bulk messages failed" << std::endl;
+        return 1;
+    }
+    
+    std::cout << "websocket_bench: one connection, echo server on loopback" << std::endl;
+    std::cout << std::fixed << std::setprecision(1)
+              << std::setw(12) << "round trip" << std::setw(10) << small_seconds * 1e6 / round_trips << " us per 32 byte message (" << round_trips << " messages)" << std::endl
+              << std::setw(12) << "throughput" << std::setw(10) << 2.0 * bulk_messages * bulk_message_size / (1024 * 1024) / bulk_seconds << " MB/s sent and received (" << bulk_messages << " x 1 MB messages)" << std::endl;
+    return 0;
+}
+
+#else
+
+int main()
+{
+    std::cout << "websocket_bench: skipped, libcurl has no WebSocket API" << std::endl;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+#include "ws_echo_server.hpp"
+
+#if defined(CURLWS_TEXT) && LIBCURL_VERSION_NUM >= 0x075600
+
+int main()
+{
+    if (!websocket_supported())
+    {
+        std::cout << "websocket_test: skipped, libcurl has no WebSocket support" << std::endl;
+        return 0;
+    }
+    
+    test_watchdog(30);
+    ws_echo_server server;
+    server.read_delay_ms = 300;
+    server.start();
+    
+    std::string large(4 * 1024 * 1024, 'x');
+    for (std::size_t i = 0; i < large.size(); ++i)
+        large[i] = static_cast<char>('a' + i % 23);
+    
+    boost::asio::io_service io;
+    curl_asio curl(io);
+    ws_echo_client c;
+    c.outgoing.push_back("hello");
+    c.outgoing.push_back(large);
+    c.outgoing.push_back("bye");
+    
+    c.ws = curl_asio::websocket::create(curl.create_transfer());
+    CHECK(c.ws);
+    CHECK(c.ws->async_connect(server.url(), boost::bind(on_connected, &c, _1)));
+    io.run();
+    
+    CHECK(c.error == CURLE_OK);
+    CHECK(!server.protocol_error);
+    CHECK(server.messages.size() == 3);
+    CHECK(server.frames.size() == 3);
+    CHECK(c.received.size() == 3);
+    for (std::size_t i = 0; i < c.outgoing.size(); ++i)
+    {
+        CHECK(i < server.messages.size() && server.messages[i] == c.outgoing[i]);
+        CHECK(i < c.received.size() && c.received[i] == c.outgoing[i]);
+    }
+    c.ws.reset();
+    return test_result("websocket_test");
+}
+
+#else
+
+int main()
+{
+    std::cout << "websocket_test: skipped, libcurl has no WebSocket API" << std::endl;
+    return 0;
+}
+
+#endif
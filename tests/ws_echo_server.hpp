@@ -0,0 +1,292 @@
+#ifndef CURL_ASIO_WS_ECHO_SERVER__HPP
+#define CURL_ASIO_WS_ECHO_SERVER__HPP
+
+#include "curl_asio.hpp"
+#include "test_server.hpp"
+
+#if defined(CURLWS_TEXT) && LIBCURL_VERSION_NUM >= 0x075600
+
+#include <openssl/sha.h>
+
+class ws_echo_server
+{
+public:
+    struct frame
+    {
+        int opcode;
+        bool fin;
+        std::size_t size;
+    };
+    
+    ws_echo_server()
+        : read_delay_ms(0),
+          protocol_error(false),
+          acceptor_(io_, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+    {
+    }
+    
+    ~ws_echo_server()
+    {
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        if (thread_.joinable())
+            thread_.join();
+    }
+    
+    void start()
+    {
+        thread_ = boost::thread(boost::bind(&ws_echo_server::serve, this));
+    }
+    
+    std::string url() const
+    {
+        std::ostringstream os;
+        os << "ws://127.0.0.1:" << acceptor_.local_endpoint().port() << "/echo";
+        return os.str();
+    }
+    
+    long read_delay_ms;
+    std::vector<frame> frames;
+    std::vector<std::string> messages;
+    bool protocol_error;
+
+private:
+    boost::asio::io_service io_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    boost::thread thread_;
+    
+    static std::string accept_key(const std::string& key)
+    {
+        std::string input(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        ::SHA1(reinterpret_cast<const unsigned char*>(input.data()), input.size(), digest);
+        
+        static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string ret;
+        for (std::size_t i = 0; i < sizeof(digest); i += 3)
+        {
+            unsigned long n = static_cast<unsigned long>(digest[i]) << 16;
+            if (i + 1 < sizeof(digest))
+                n |= static_cast<unsigned long>(digest[i + 1]) << 8;
+            if (i + 2 < sizeof(digest))
+                n |= digest[i + 2];
+            ret += alphabet[(n >> 18) & 63];
+            ret += alphabet[(n >> 12) & 63];
+            ret += i + 1 < sizeof(digest) ? alphabet[(n >> 6) & 63] : '=';
+            ret += i + 2 < sizeof(digest) ? alphabet[n & 63] : '=';
+        }
+        return ret;
+    }
+    
+    static void write_frame(boost::asio::ip::tcp::socket& socket, int opcode, const std::string& payload)
+    {
+        std::string head(1, static_cast<char>(0x80 | opcode));
+        if (payload.size() < 126)
+            head += static_cast<char>(payload.size());
+        else if (payload.size() < 65536)
+        {
+            head += static_cast<char>(126);
+            head += static_cast<char>(payload.size() >> 8);
+            head += static_cast<char>(payload.size() & 0xff);
+        }
+        else
+        {
+            head += static_cast<char>(127);
+            for (int shift = 56; shift >= 0; shift -= 8)
+                head += static_cast<char>((static_cast<boost::uint64_t>(payload.size()) >> shift) & 0xff);
+        }
+        std::vector<boost::asio::const_buffer> buffers;
+        buffers.push_back(boost::asio::buffer(head));
+        buffers.push_back(boost::asio::buffer(payload));
+        boost::asio::write(socket, buffers);
+    }
+    
+    bool read_frame(boost::asio::ip::tcp::socket& socket, boost::asio::streambuf& pending, frame& f, std::string& payload)
+    {
+        unsigned char head[2];
+        read_exactly(socket, pending, head, 2);
+        f.fin = (head[0] & 0x80) != 0;
+        f.opcode = head[0] & 0x0f;
+        if (!(head[1] & 0x80))
+            return false;
+        
+        boost::uint64_t size = head[1] & 0x7f;
+        if (size == 126 || size == 127)
+        {
+            unsigned char ext[8];
+            std::size_t n = size == 126 ? 2 : 8;
+            read_exactly(socket, pending, ext, n);
+            size = 0;
+            for (std::size_t i = 0; i < n; ++i)
+                size = (size << 8) | ext[i];
+        }
+        
+        unsigned char mask[4];
+        read_exactly(socket, pending, mask, 4);
+        payload.resize(static_cast<std::size_t>(size));
+        if (size)
+            read_exactly(socket, pending, &payload[0], payload.size());
+        for (std::size_t i = 0; i < payload.size(); ++i)
+            payload[i] ^= mask[i & 3];
+        f.size = payload.size();
+        return true;
+    }
+    
+    static void read_exactly(boost::asio::ip::tcp::socket& socket, boost::asio::streambuf& pending, void *data, std::size_t size)
+    {
+        if (pending.size() < size)
+            boost::asio::read(socket, pending, boost::asio::transfer_at_least(size - pending.size()));
+        boost::asio::buffer_copy(boost::asio::buffer(data, size), pending.data());
+        pending.consume(size);
+    }
+    
+    void serve()
+    {
+        try
+        {
+            boost::asio::ip::tcp::socket socket(io_);
+            acceptor_.accept(socket);
+            socket.set_option(boost::asio::ip::tcp::no_delay(true));
+            
+            boost::asio::streambuf pending;
+            boost::asio::read_until(socket, pending, "\r\n\r\n");
+            std::string request(boost::asio::buffers_begin(pending.data()), boost::asio::buffers_end(pending.data()));
+            pending.consume(request.find("\r\n\r\n") + 4);
+            
+            std::string key;
+            std::string::size_type pos = request.find("Sec-WebSocket-Key: ");
+            if (pos != std::string::npos)
+                key = request.substr(pos + 19, request.find("\r\n", pos) - pos - 19);
+            
+            std::string response("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + accept_key(key) + "\r\n\r\n");
+            boost::asio::write(socket, boost::asio::buffer(response));
+            
+            if (read_delay_ms)
+                boost::this_thread::sleep(boost::posix_time::milliseconds(read_delay_ms));
+            
+            std::string message;
+            int message_opcode = 0;
+            for (;;)
+            {
+                frame f;
+                std::string payload;
+                if (!read_frame(socket, pending, f, payload))
+                {
+                    protocol_error = true;
+                    return;
+                }
+                frames.push_back(f);
+                
+                if (f.opcode == 8)
+                {
+                    write_frame(socket, 8, payload);
+                    return;
+                }
+                
+                if (f.opcode != 0)
+                {
+                    if (!message.empty() || message_opcode)
+                        protocol_error = true;
+                    message_opcode = f.opcode;
+                }
+                message += payload;
+                if (f.fin)
+                {
+                    messages.push_back(message);
+                    write_frame(socket, message_opcode, message);
+                    message.clear();
+                    message_opcode = 0;
+                }
+            }
+        }
+        catch (const boost::system::system_error&)
+        {
+        }
+    }
+};
+
+struct ws_echo_client
+{
+    curl_asio::websocket::ptr ws;
+    std::vector<std::string> outgoing;
+    std::size_t next;
+    std::vector<char> buffer;
+    std::string incoming;
+    std::vector<std::string> received;
+    CURLcode error;
+    
+    ws_echo_client()
+        : next(0),
+          buffer(64 * 1024),
+          error(CURLE_OK)
+    {
+    }
+};
+
+inline void send_next(ws_echo_client *c);
+
+inline void on_received(ws_echo_client *c, CURLcode rc, std::size_t size, int flags, curl_off_t bytesleft)
+{
+    if (rc != CURLE_OK)
+    {
+        c->error = rc;
+        c->ws->close();
+        return;
+    }
+    
+    c->incoming.append(&c->buffer[0], size);
+    if (bytesleft == 0 && !(flags & CURLWS_CONT))
+    {
+        c->received.push_back(c->incoming);
+        c->incoming.clear();
+        send_next(c);
+    }
+    else
+        c->ws->async_receive(boost::asio::buffer(c->buffer), boost::bind(on_received, c, _1, _2, _3, _4));
+}
+
+inline void on_sent(ws_echo_client *c, CURLcode rc, std::size_t sent)
+{
+    if (rc != CURLE_OK || sent != c->outgoing[c->next - 1].size())
+    {
+        c->error = rc != CURLE_OK ? rc : CURLE_SEND_ERROR;
+        c->ws->close();
+        return;
+    }
+    
+    c->ws->async_receive(boost::asio::buffer(c->buffer), boost::bind(on_received, c, _1, _2, _3, _4));
+}
+
+inline void send_next(ws_echo_client *c)
+{
+    if (c->next == c->outgoing.size())
+    {
+        c->ws->close();
+        return;
+    }
+    
+    const std::string& message(c->outgoing[c->next++]);
+    c->ws->async_send(boost::asio::buffer(message), CURLWS_TEXT, boost::bind(on_sent, c, _1, _2));
+}
+
+inline void on_connected(ws_echo_client *c, CURLcode rc)
+{
+    c->error = rc;
+    if (rc == CURLE_OK)
+        send_next(c);
+}
+
+inline bool websocket_supported()
+{
+    curl_version_info_data *info = ::curl_version_info(CURLVERSION_NOW);
+    for (const char * const *protocol = info->protocols; *protocol; ++protocol)
+    {
+        if (std::string(*protocol) == "ws")
+            return true;
+    }
+    return false;
+}
+
+#endif
+
+#endif